@@ -0,0 +1,55 @@
+-- build a large output: a table of strings and table.concat, io.write
+-- per fragment, or a mylib.buffer
+--     lua bench_buffer.lua 1000000
+local mylib = require "mylib"
+
+local N = tonumber(arg and arg[1]) or 500000 -- records
+
+local function run (name, f)
+    collectgarbage()
+    collectgarbage("stop") -- count what each way allocates in Lua
+    local mem0 = collectgarbage("count")
+    local t0 = os.clock()
+    local n = f()
+    local t = os.clock() - t0
+    local kb = collectgarbage("count") - mem0
+    collectgarbage("restart")
+    print(string.format("%-28s %7.3fs %9.1f MB garbage  %d bytes",
+            name, t, kb / 1024, n))
+end
+
+run("table + table.concat", function ()
+    local t = {}
+    for i = 1, N do
+        t[#t + 1] = string.format("\t[%q] = %d,\n", "key" .. i % 100, i)
+    end
+    return #table.concat(t)
+end)
+run("buffer:appendf", function ()
+    local b = mylib.buffer()
+    for i = 1, N do b:appendf("\t[%q] = %d,\n", "key" .. i % 100, i) end
+    return #b
+end)
+run("buffer:append", function ()
+    local b = mylib.buffer()
+    for i = 1, N do b:append("\t[\"key", i % 100, "\"] = ", i, ",\n") end
+    return #b
+end)
+
+local devnull = assert(io.open("/dev/null", "w"))
+run("io.write per fragment", function ()
+    for i = 1, N do
+        devnull:write("\t[\"key", i % 100, "\"] = ", i, ",\n")
+    end
+    return 0
+end)
+run("buffer, flushto every 64 KB", function ()
+    local b = mylib.buffer(65536)
+    for i = 1, N do
+        b:append("\t[\"key", i % 100, "\"] = ", i, ",\n")
+        if #b >= 65536 then b:flushto(devnull) end
+    end
+    b:flushto(devnull)
+    return 0
+end)
+devnull:close()
@@ -0,0 +1,26 @@
+-- join many fragments: table.concat against mylib.t_concat
+--     lua bench_concat.lua 2000000
+local mylib = require "mylib"
+
+local N = tonumber(arg and arg[1]) or 1000000 -- fragments
+
+local strings, numbers = {}, {}
+for i = 1, N do
+    strings[i] = string.format("field%d", i % 1000)
+    numbers[i] = (i % 2 == 0) and i or i / 8
+end
+
+local function run (name, f)
+    collectgarbage()
+    local t0 = os.clock()
+    local r = f()
+    print(string.format("%-32s %7.3fs  %d bytes", name, os.clock() - t0, #r))
+end
+
+run("strings, table.concat", function () return table.concat(strings, ",") end)
+run("strings, t_concat", function () return mylib.t_concat(strings, ",") end)
+run("numbers, table.concat", function () return table.concat(numbers, ",") end)
+run("numbers, t_concat", function () return mylib.t_concat(numbers, ",") end)
+run("half range, t_concat", function ()
+    return mylib.t_concat(strings, ",", 1, N // 2)
+end)
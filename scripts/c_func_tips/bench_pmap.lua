@@ -0,0 +1,35 @@
+-- map against pmap with a CPU-heavy function:
+--     lua bench_pmap.lua 200000 4
+local mylib = require "mylib"
+
+local N = tonumber(arg and arg[1]) or 200000 -- elements
+local W = tonumber(arg and arg[2]) -- workers (default: number of CPUs)
+
+local function work (x) -- some floating-point work per element
+    local s = 0
+    for k = 1, 200 do s = s + math.sin(x * k) / k end
+    return s
+end
+
+local function fresh ()
+    local t = {}
+    for i = 1, N do t[i] = i end
+    return t
+end
+
+local function run (name, f)
+    local t = fresh()
+    local t0 = os.time()
+    local c0 = os.clock()
+    f(t)
+    print(string.format("%-24s %7.3fs cpu  %4ds wall  t[N] = %.6f",
+            name, os.clock() - c0, os.time() - t0, t[N]))
+end
+
+run("map", function (t) mylib.map(t, work) end)
+for _, chunk in ipairs{100, 10000} do
+    run("pmap, chunk " .. chunk, function (t)
+        mylib.pmap(t, work, {workers = W, chunk = chunk})
+    end)
+end
+run("pmap, default chunk", function (t) mylib.pmap(t, work, {workers = W}) end)
@@ -0,0 +1,35 @@
+-- split one long line into fields, building a table or iterating:
+--     lua bench_split.lua 2000000
+local mylib = require "mylib"
+
+local N = tonumber(arg and arg[1]) or 1000000 -- fields
+
+local fields = {}
+for i = 1, N do fields[i] = string.format("f%d=%d", i % 97, i) end
+local line = table.concat(fields, " | ")
+
+local function run (name, f)
+    collectgarbage()
+    local t0 = os.clock()
+    local n = f()
+    print(string.format("%-24s %7.3fs  %d fields", name, os.clock() - t0, n))
+end
+
+print(string.format("line: %.1f MB", #line / 2^20))
+run("string.gmatch", function ()
+    local n = 0
+    for _ in string.gmatch(line .. " | ", "(.-) | ") do n = n + 1 end
+    return n
+end)
+run("split (table)", function () return #mylib.split(line, " | ") end)
+run("gsplit", function ()
+    local n = 0
+    for _ in mylib.gsplit(line, " | ") do n = n + 1 end
+    return n
+end)
+run("gsplit, positions", function ()
+    local n = 0
+    for _ in mylib.gsplit(line, " | ", true) do n = n + 1 end
+    return n
+end)
+run("split, 1-byte separator", function () return #mylib.split(line, "|") end)
@@ -54,16 +54,132 @@ int l_map (lua_State *L) {
 }
 
 
+/* pmap(t, f [, opts]): like map, for a function 'f' without upvalues
+   (except _ENV) and elements that are nil, booleans, numbers or
+   strings; opts.workers (default: number of CPUs) threads map chunks
+   of opts.chunk elements (default: a quarter of each worker's share) */
+int l_pmap (lua_State *L) {
+    PMap pm;
+    DumpState d;
+    pthread_t threads[64];
+    lua_Integer i, workers, started = 0;
+    const char *msg;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    luaL_argcheck(L, !lua_iscfunction(L, 2) && onlyenv(L, 2), 2,
+            "Lua function without upvalues expected");
+    lua_settop(L, 3);
+
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    pm.n = (lua_Integer)lua_rawlen(L, 1);
+    pm.chunk = 0;
+    if (!lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "workers");
+        workers = luaL_optinteger(L, -1, workers);
+        lua_getfield(L, 3, "chunk");
+        pm.chunk = luaL_optinteger(L, -1, 0);
+        lua_pop(L, 2);
+    }
+    if (workers < 1)
+        workers = 1;
+    if (workers > (lua_Integer)(sizeof(threads) / sizeof(threads[0])))
+        workers = sizeof(threads) / sizeof(threads[0]);
+    if (pm.chunk <= 0)
+        pm.chunk = pm.n / (4 * workers) + 1;
+    if (pm.n <= 0)
+        return 0;
+    if (pm.chunk > pm.n) /* also keeps chunk offsets from overflowing */
+        pm.chunk = pm.n;
+    pm.nchunks = (pm.n + pm.chunk - 1) / pm.chunk;
+    if (workers > pm.nchunks)
+        workers = pm.nchunks;
+
+    /* the elements; the userdata takes care of the memory on errors.
+       They are read raw, so that their strings stay anchored in the
+       table while the workers use them */
+    pm.in = (PValue *)lua_newuserdatauv(L, 2 * pm.n * sizeof(PValue), 0);
+    pm.out = pm.in + pm.n;
+    for (i = 0; i < pm.n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        if ((msg = topvalue(L, -1, &pm.in[i], 0)) != NULL)
+            return luaL_error(L, "element %I: cannot map a %s", i + 1, msg);
+        pm.out[i].type = LUA_TNIL;
+        lua_pop(L, 1);
+    }
+
+    lua_pushvalue(L, 2);
+    d.init = 0;
+    lua_dump(L, pmap_writer, &d, 0);
+    luaL_pushresult(&d.b);
+    lua_remove(L, -2); /* the copy of 'f' */
+    pm.code = lua_tolstring(L, -1, &pm.codelen);
+
+    atomic_init(&pm.next, 0);
+    atomic_init(&pm.failed, 0);
+    pm.error = NULL;
+    pthread_mutex_init(&pm.lock, NULL);
+    while (started < workers &&
+            pthread_create(&threads[started], NULL, pmap_worker, &pm) == 0)
+        started++;
+    if (started == 0) /* no threads: map here */
+        pmap_worker(&pm);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pm.lock);
+
+    /* write the results back in order, freeing their strings */
+    for (i = 0; i < pm.n; i++) {
+        if (!pm.failed)
+            pushpvalue(L, &pm.out[i]);
+        if (pm.out[i].type == LUA_TSTRING)
+            free((char *)pm.out[i].u.str.s);
+        if (!pm.failed)
+            lua_seti(L, 1, i + 1);
+    }
+    if (pm.failed) {
+        lua_pushstring(L, pm.error ? pm.error : "not enough memory");
+        free(pm.error);
+        return lua_error(L);
+    }
+    return 0; /* no results */
+}
+
+
 static const struct luaL_Reg mylib [] = {
     {"map", l_map},
+    {"pmap", l_pmap},
     {"split", l_split},
+    {"gsplit", l_gsplit},
     {"new_tuple", t_new},
     {"t_concat", tconcat},
     {"newCounter", newCounter},
+    {"buffer", newbuffer},
+    {NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg buffer_m [] = {
+    {"append", appendbuffer},
+    {"appendf", appendfbuffer},
+    {"rep", repbuffer},
+    {"reserve", reservemethod},
+    {"reset", resetbuffer},
+    {"tostring", buffer2string},
+    {"flushto", flushbuffer},
+    {"__tostring", buffer2string},
+    {"__len", lenbuffer},
+    {"__gc", gcbuffer},
     {NULL, NULL} /* sentinel */
 };
 
 int luaopen_mylib (lua_State *L) {
+    luaL_newmetatable(L, "LuaBook.buffer");
+    lua_pushvalue(L, -1); /* duplicate the metatable */
+    lua_setfield(L, -2, "__index"); /* mt.__index = mt */
+    luaL_setfuncs(L, buffer_m, 0); /* register methods */
+    lua_pop(L, 1); /* pop metatable */
+
     luaL_newlib(L, mylib);
     return 1;
 }
@@ -1,46 +1,212 @@
 #ifndef TIPS_LIB_H
 #define TIPS_LIB_H
 
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "lua.h"
+#include "lualib.h"
+
+/* first occurrence of 'sep' in the 'n' bytes at 's', or NULL */
+static const char *findsep (const char *s, size_t n,
+        const char *sep, size_t lsep) {
+    const char *end = s + n;
+
+    if (lsep == 1) /* single byte: memchr alone */
+        return (const char *)memchr(s, *sep, n);
+    while (lsep <= (size_t)(end - s) &&
+            (s = (const char *)memchr(s, *sep, end - s - lsep + 1)) != NULL) {
+        if (memcmp(s + 1, sep + 1, lsep - 1) == 0)
+            return s;
+        s++;
+    }
+    return NULL;
+}
+
+static const char *checksep (lua_State *L, int arg, size_t *lsep) {
+    const char *sep = luaL_checklstring(L, arg, lsep);
+    luaL_argcheck(L, *lsep > 0, arg, "empty separator");
+    return sep;
+}
 
 static int l_split (lua_State *L) {
-    const char *s = luaL_checkstring(L, 1); /* subject */
-    const char *sep = luaL_checkstring(L, 2); /* separator */
+    size_t ls, lsep;
+    const char *s = luaL_checklstring(L, 1, &ls); /* subject */
+    const char *sep = checksep(L, 2, &lsep); /* separator */
+    const char *end = s + ls;
     const char *e;
-    int i = 1;
+    lua_Integer i = 1;
 
     lua_newtable(L); /* result table */
 
     /* repeat for each separator */
-    while ((e = strchr(s, *sep)) != NULL) {
+    while ((e = findsep(s, end - s, sep, lsep)) != NULL) {
         lua_pushlstring(L, s, e - s); /* push substring */
         lua_rawseti(L, -2, i++); /* insert it in table */
-        s = e + 1; /* skip separator */
+        s = e + lsep; /* skip separator */
     }
 
     /* insert last substring */
-    lua_pushstring(L, s);
+    lua_pushlstring(L, s, end - s);
     lua_rawseti(L, -2, i);
 
     return 1; /* return the table */
 }
 
+/* upvalues: subject, separator, offset of the next field (-1 after the
+   last one) and whether to return positions instead of fields */
+static int gsplit_aux (lua_State *L) {
+    size_t ls, lsep, len;
+    const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+    const char *sep = lua_tolstring(L, lua_upvalueindex(2), &lsep);
+    lua_Integer pos = lua_tointeger(L, lua_upvalueindex(3));
+    const char *e;
+
+    if (pos < 0)
+        return 0; /* no more fields */
+    e = findsep(s + pos, ls - pos, sep, lsep);
+    len = (e != NULL) ? (size_t)(e - (s + pos)) : ls - pos;
+
+    lua_pushinteger(L, (e != NULL) ? pos + (lua_Integer)(len + lsep) : -1);
+    lua_replace(L, lua_upvalueindex(3)); /* update position */
+
+    if (lua_toboolean(L, lua_upvalueindex(4))) {
+        lua_pushinteger(L, pos + 1); /* field is s:sub(i, j) */
+        lua_pushinteger(L, pos + (lua_Integer)len);
+        return 2;
+    }
+    lua_pushlstring(L, s + pos, len);
+    return 1;
+}
+
+/* for field in gsplit(s, sep) do ... end: the fields of 'split',
+   one at a time; with a true 'positions', the iterator gives the start
+   and end of each field instead, copying nothing */
+static int l_gsplit (lua_State *L) {
+    size_t lsep;
 
+    luaL_checkstring(L, 1);
+    checksep(L, 2, &lsep);
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, 0); /* start at the first byte */
+    lua_pushboolean(L, lua_toboolean(L, 3));
+    lua_pushcclosure(L, gsplit_aux, 4);
+    return 1;
+}
+
+
+#define NUMBUFF 64 /* room for a number converted to text */
+#define MAXSIZE ((size_t)-1 >> 1) /* limit for the length of a result */
+
+/* text of the number at 'idx', as lua_tostring gives it, into 'buff' */
+static size_t numtext (lua_State *L, int idx, char *buff) {
+    int len;
+
+    if (lua_isinteger(L, idx))
+        return snprintf(buff, NUMBUFF, LUA_INTEGER_FMT,
+                (LUAI_UACINT)lua_tointeger(L, idx));
+    len = snprintf(buff, NUMBUFF, LUA_NUMBER_FMT,
+            (LUAI_UACNUMBER)lua_tonumber(L, idx));
+    if (buff[strspn(buff, "-0123456789")] == '\0') { /* looks like an int? */
+        buff[len++] = '.'; /* add '.0' */
+        buff[len++] = '0';
+    }
+    return len;
+}
+
+/* length of element 'i' of the table at 1 (read with lua_rawgeti if
+   'raw', when the table has no metatable); numbers are formatted into
+   'buff', strings are returned in '*s' and stay on the stack */
+static size_t fragment (lua_State *L, lua_Integer i, const char **s,
+        char *buff, int raw) {
+    size_t len;
+
+    if (raw)
+        lua_rawgeti(L, 1, i);
+    else
+        lua_geti(L, 1, i);
+    if (lua_type(L, -1) == LUA_TSTRING)
+        *s = lua_tolstring(L, -1, &len);
+    else if (lua_type(L, -1) == LUA_TNUMBER) {
+        len = numtext(L, -1, buff);
+        *s = buff;
+    }
+    else
+        return luaL_error(L, "invalid value (at index %I) in table for "
+                "'concat'", i);
+    return len;
+}
+
+/* t_concat(t [, sep [, i [, j]]]): like table.concat, in two passes: the
+   first adds up the lengths, so that the second writes the result into
+   a buffer allocated just once */
 static int tconcat (lua_State *L) {
     luaL_Buffer b;
-    int i, n;
+    size_t lsep, total = 0, left, len;
+    const char *sep = luaL_optlstring(L, 2, "", &lsep);
+    const char *s;
+    char buff[NUMBUFF];
+    char *p;
+    lua_Integer i, j, k;
+    int raw;
 
     luaL_checktype(L, 1, LUA_TTABLE);
-    n = luaL_len(L, 1);
-    luaL_buffinit(L, &b);
+    raw = 1;
+    if (lua_getmetatable(L, 1)) { /* metamethods may apply */
+        raw = 0;
+        lua_pop(L, 1);
+    }
+    i = luaL_optinteger(L, 3, 1);
+    j = luaL_opt(L, luaL_checkinteger, 4, luaL_len(L, 1));
+    lua_settop(L, 4);
+    if (i > j) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
 
-    for (i = 1; i <= n; i++) {
-        lua_geti(L, 1, i); /* get string from table */
-        luaL_addvalue(&b); /* add it to the buffer */
+    for (k = i; ; k++) { /* first pass: the length of the result */
+        len = fragment(L, k, &s, buff, raw);
+        lua_pop(L, 1);
+        if (len > MAXSIZE - total)
+            return luaL_error(L, "resulting string too large");
+        total += len;
+        if (k == j)
+            break;
+        if (lsep > MAXSIZE - total)
+            return luaL_error(L, "resulting string too large");
+        total += lsep;
     }
 
-    luaL_pushresult(&b);
+    /* second pass: copy the fragments; __index metamethods could give
+       other values this time, so check that they still fit */
+    p = luaL_buffinitsize(L, &b, total);
+    left = total;
+    for (k = i; ; k++) {
+        len = fragment(L, k, &s, buff, raw);
+        if (len > left)
+            return luaL_error(L, "table changed during 'concat'");
+        memcpy(p, s, len);
+        p += len;
+        left -= len;
+        lua_pop(L, 1);
+        if (k == j)
+            break;
+        if (lsep > left)
+            return luaL_error(L, "table changed during 'concat'");
+        memcpy(p, sep, lsep);
+        p += lsep;
+        left -= lsep;
+    }
+    if (left != 0)
+        return luaL_error(L, "table changed during 'concat'");
+    luaL_pushresultsize(&b, total);
     return 1;
 }
 
@@ -51,4 +217,526 @@ static int counter (lua_State *L) {
     return 1; /* return new value */
 }
 
+
+/*
+** pmap: a map over the array part of a table on several threads, each
+** with its own Lua state. The function is copied to the states as
+** bytecode and the elements as PValues: nil, booleans, numbers and
+** strings. Input strings point into the table, which cannot change
+** while the caller waits; result strings are copied with malloc.
+*/
+
+typedef struct PValue {
+    int type;
+    union {
+        int b;
+        lua_Integer i;
+        lua_Number n;
+        struct {
+            const char *s;
+            size_t len;
+        } str;
+    } u;
+} PValue;
+
+typedef struct PMap {
+    const char *code; /* the dumped function */
+    size_t codelen;
+    PValue *in, *out;
+    lua_Integer n, chunk, nchunks;
+    atomic_llong next; /* next chunk to map */
+    atomic_int failed;
+    char *error; /* first error message, set under 'lock' */
+    pthread_mutex_t lock;
+} PMap;
+
+/* value at 'idx' into 'v'; result strings are copied if 'copy' */
+static const char *topvalue (lua_State *L, int idx, PValue *v, int copy) {
+    v->type = lua_type(L, idx);
+    switch (v->type) {
+        case LUA_TNIL:
+            break;
+        case LUA_TBOOLEAN:
+            v->u.b = lua_toboolean(L, idx);
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, idx))
+                v->u.i = lua_tointeger(L, idx);
+            else {
+                v->type = -LUA_TNUMBER; /* a float */
+                v->u.n = lua_tonumber(L, idx);
+            }
+            break;
+        case LUA_TSTRING: {
+            const char *s = lua_tolstring(L, idx, &v->u.str.len);
+            char *c;
+            if (!copy) {
+                v->u.str.s = s;
+                break;
+            }
+            if ((c = (char *)malloc(v->u.str.len + 1)) == NULL) {
+                v->type = LUA_TNIL;
+                return "not enough memory";
+            }
+            memcpy(c, s, v->u.str.len);
+            v->u.str.s = c;
+            break;
+        }
+        default:
+            v->type = LUA_TNIL;
+            return lua_typename(L, lua_type(L, idx));
+    }
+    return NULL;
+}
+
+static void pushpvalue (lua_State *L, const PValue *v) {
+    switch (v->type) {
+        case LUA_TBOOLEAN: lua_pushboolean(L, v->u.b); break;
+        case LUA_TNUMBER: lua_pushinteger(L, v->u.i); break;
+        case -LUA_TNUMBER: lua_pushnumber(L, v->u.n); break;
+        case LUA_TSTRING: lua_pushlstring(L, v->u.str.s, v->u.str.len); break;
+        default: lua_pushnil(L); break;
+    }
+}
+
+static void pmap_error (PMap *pm, const char *fmt, const char *msg,
+        lua_Integer i) {
+    size_t len = strlen(msg) + strlen(fmt) + 32;
+
+    atomic_store(&pm->failed, 1);
+    pthread_mutex_lock(&pm->lock);
+    if (pm->error == NULL && (pm->error = (char *)malloc(len)) != NULL)
+        snprintf(pm->error, len, fmt, (long long)i, msg);
+    pthread_mutex_unlock(&pm->lock);
+}
+
+/* a worker: map chunks until there are none left or one fails */
+static void *pmap_worker (void *arg) {
+    PMap *pm = (PMap *)arg;
+    lua_State *L = luaL_newstate();
+    lua_Integer c, i, last;
+    const char *msg;
+
+    if (L == NULL) {
+        pmap_error(pm, "%lld: %s", "cannot create state", 0);
+        return NULL;
+    }
+    luaL_openlibs(L);
+    if (luaL_loadbufferx(L, pm->code, pm->codelen, "=pmap", "b") != LUA_OK) {
+        pmap_error(pm, "%lld: %s", lua_tostring(L, -1), 0);
+        lua_close(L);
+        return NULL;
+    }
+    while (!atomic_load(&pm->failed) &&
+            (c = atomic_fetch_add(&pm->next, 1)) < pm->nchunks) {
+        last = (c + 1) * pm->chunk;
+        for (i = c * pm->chunk; i < last && i < pm->n; i++) {
+            lua_pushvalue(L, 1); /* f */
+            pushpvalue(L, &pm->in[i]);
+            if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+                pmap_error(pm, "element %lld: %s", lua_tostring(L, -1), i + 1);
+                goto done;
+            }
+            if ((msg = topvalue(L, -1, &pm->out[i], 1)) != NULL) {
+                pmap_error(pm, "element %lld: cannot return a %s", msg, i + 1);
+                goto done;
+            }
+            lua_pop(L, 1);
+        }
+    }
+done:
+    lua_close(L);
+    return NULL;
+}
+
+/* whether the function at 'arg' uses no upvalue but _ENV */
+static int onlyenv (lua_State *L, int arg) {
+    const char *name;
+    int i;
+
+    for (i = 1; (name = lua_getupvalue(L, arg, i)) != NULL; i++) {
+        lua_pop(L, 1);
+        if (i > 1 || strcmp(name, "_ENV") != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* as in string.dump, the buffer starts once lua_dump has the function */
+typedef struct DumpState {
+    int init;
+    luaL_Buffer b;
+} DumpState;
+
+static int pmap_writer (lua_State *L, const void *p, size_t sz, void *ud) {
+    DumpState *d = (DumpState *)ud;
+    if (!d->init) {
+        d->init = 1;
+        luaL_buffinit(L, &d->b);
+    }
+    luaL_addlstring(&d->b, (const char *)p, sz);
+    return 0;
+}
+
+
+/*
+** String builder: a growable byte buffer kept outside Lua, so that
+** appending creates no Lua strings; the text becomes a Lua string only
+** in 'tostring'. 'reset' and 'flushto' empty it but keep its memory.
+*/
+
+#define checkbuffer(L) \
+    (StrBuffer *)luaL_checkudata(L, 1, "LuaBook.buffer")
+
+#define BUFFER_MIN 64 /* initial capacity */
+
+typedef struct StrBuffer {
+    char *data; /* NULL after __gc */
+    size_t len, cap;
+} StrBuffer;
+
+/* room for 'n' more bytes; return where they go */
+static char *reservebuffer (lua_State *L, StrBuffer *b, size_t n) {
+    if (b->data == NULL)
+        luaL_error(L, "buffer is closed");
+    if (n > b->cap - b->len) {
+        size_t cap = b->cap;
+        char *data;
+        if (n > MAXSIZE - b->len)
+            luaL_error(L, "buffer too large");
+        while (cap < b->len + n)
+            cap = (cap <= MAXSIZE / 2) ? 2 * cap : MAXSIZE;
+        if ((data = (char *)realloc(b->data, cap)) == NULL)
+            luaL_error(L, "not enough memory");
+        b->data = data;
+        b->cap = cap;
+    }
+    return b->data + b->len;
+}
+
+static void addbytes (lua_State *L, StrBuffer *b, const char *s,
+        size_t len) {
+    memcpy(reservebuffer(L, b, len), s, len);
+    b->len += len;
+}
+
+/* mylib.buffer([size]): a new buffer with room for 'size' bytes */
+static int newbuffer (lua_State *L) {
+    lua_Integer size = luaL_optinteger(L, 1, BUFFER_MIN);
+    StrBuffer *b;
+
+    luaL_argcheck(L, 0 <= size && (size_t)size <= MAXSIZE, 1, "invalid size");
+    b = (StrBuffer *)lua_newuserdatauv(L, sizeof(StrBuffer), 0);
+    b->data = NULL;
+    b->len = b->cap = 0;
+    luaL_setmetatable(L, "LuaBook.buffer");
+    if (size < BUFFER_MIN)
+        size = BUFFER_MIN;
+    if ((b->data = (char *)malloc((size_t)size)) == NULL)
+        return luaL_error(L, "not enough memory");
+    b->cap = (size_t)size;
+    return 1;
+}
+
+static int gcbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+    return 0;
+}
+
+/* append the string or number at 'arg' */
+static void addvalue (lua_State *L, StrBuffer *b, int arg) {
+    char buff[NUMBUFF];
+    const char *s;
+    size_t len;
+
+    if (lua_type(L, arg) == LUA_TNUMBER) /* no string for it */
+        addbytes(L, b, buff, numtext(L, arg, buff));
+    else {
+        s = luaL_checklstring(L, arg, &len);
+        addbytes(L, b, s, len);
+    }
+}
+
+/* b:append(...): append strings and numbers; return 'b' */
+static int appendbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    int i, n = lua_gettop(L);
+
+    for (i = 2; i <= n; i++)
+        addvalue(L, b, i);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* b:rep(s, n [, sep]): append 'n' copies of 's' separated by 'sep';
+   return 'b' */
+static int repbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    size_t len, lsep;
+    const char *s = luaL_checklstring(L, 2, &len);
+    lua_Integer n = luaL_checkinteger(L, 3);
+    const char *sep = luaL_optlstring(L, 4, "", &lsep);
+    char *p;
+
+    if (n > 0) {
+        if (len + lsep < len || len + lsep > MAXSIZE / n)
+            return luaL_error(L, "resulting buffer too large");
+        p = reservebuffer(L, b, (size_t)n * (len + lsep) - lsep);
+        while (n-- > 0) {
+            memcpy(p, s, len);
+            p += len;
+            if (n > 0 && lsep > 0) {
+                memcpy(p, sep, lsep);
+                p += lsep;
+            }
+        }
+        b->len = p - b->data;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* b:reserve(n): make room for 'n' more bytes; return 'b' */
+static int reservemethod (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    lua_Integer n = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, 0 <= n && (size_t)n <= MAXSIZE, 2, "invalid size");
+    reservebuffer(L, b, (size_t)n);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* b:reset(): empty the buffer, keeping its memory; return 'b' */
+static int resetbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    b->len = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* b:tostring() (also __tostring): the contents as a string */
+static int buffer2string (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    lua_pushlstring(L, b->data, b->len);
+    return 1;
+}
+
+static int lenbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    lua_pushinteger(L, (lua_Integer)b->len);
+    return 1;
+}
+
+/* b:flushto(file): write the contents to an io file and empty the
+   buffer; return 'b', or nil plus an error message */
+static int flushbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    luaL_Stream *f = (luaL_Stream *)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+
+    luaL_argcheck(L, f->closef != NULL, 2, "attempt to use a closed file");
+    if (b->len > 0 && fwrite(b->data, 1, b->len, f->f) != b->len)
+        return luaL_fileresult(L, 0, NULL);
+    b->len = 0;
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+** appendf: string.format into the buffer. Each conversion is done by
+** snprintf straight into the free space, growing it and trying again
+** when the result does not fit. Conversions take the same flags and
+** precisions as in string.format (Lua 5.4), and no others.
+*/
+
+#define FMT_FLAGS "-+ #0" /* all flags */
+#define FMT_FLAGSC "-" /* flags for each conversion */
+#define FMT_FLAGSI "-+0 "
+#define FMT_FLAGSU "-0"
+#define FMT_FLAGSX "-#0"
+#define FMT_FLAGSF "-+#0 "
+#define MAX_FORMAT 32
+
+#define addformatted(L, b, form, v) { \
+    size_t room_ = b->cap - b->len; \
+    int n_ = snprintf(b->data + b->len, room_, form, v); \
+    if (n_ < 0) \
+        luaL_error(L, "invalid conversion '%s' to 'appendf'", form); \
+    if ((size_t)n_ >= room_) { \
+        reservebuffer(L, b, (size_t)n_ + 1); \
+        snprintf(b->data + b->len, (size_t)n_ + 1, form, v); \
+    } \
+    b->len += n_; \
+}
+
+/* read a conversion spec after '%' into 'form' ("%" ... conversion),
+   with 'lenmod' before the conversion; only the given 'flags' and (if
+   'precision') a precision are valid. Return the conversion */
+static int scanformat (lua_State *L, const char **fmt, char *form,
+        const char *lenmod, const char *flags, int precision) {
+    const char *p = *fmt, *start = *fmt;
+    size_t len, lmod = strlen(lenmod);
+
+    p += strspn(p, flags);
+    if (*p != '0') { /* width (not starting with a '0' flag) */
+        if (isdigit((unsigned char)*p)) p++; /* two digits at most */
+        if (isdigit((unsigned char)*p)) p++;
+    }
+    if (precision && *p == '.') { /* precision: two digits at most */
+        p++;
+        if (isdigit((unsigned char)*p)) p++;
+        if (isdigit((unsigned char)*p)) p++;
+    }
+    len = p - start;
+    if (!isalpha((unsigned char)*p) || len + lmod + 3 > MAX_FORMAT)
+        luaL_error(L, "invalid conversion '%%%s' to 'appendf'", start);
+    form[0] = '%';
+    memcpy(form + 1, start, len);
+    memcpy(form + 1 + len, lenmod, lmod);
+    form[1 + len + lmod] = *p;
+    form[2 + len + lmod] = '\0';
+    *fmt = p + 1;
+    return (unsigned char)*p;
+}
+
+/* %q: the value as a Lua literal, as string.format gives it */
+static void addquoted (lua_State *L, StrBuffer *b, int arg) {
+    char buff[NUMBUFF];
+    size_t len, i;
+    const char *s;
+
+    switch (lua_type(L, arg)) {
+        case LUA_TSTRING:
+            s = lua_tolstring(L, arg, &len);
+            addbytes(L, b, "\"", 1);
+            for (i = 0; i < len; i++) {
+                unsigned char c = (unsigned char)s[i];
+                if (c == '"' || c == '\\' || c == '\n') {
+                    addbytes(L, b, "\\", 1);
+                    addbytes(L, b, (const char *)&s[i], 1);
+                }
+                else if (iscntrl(c)) {
+                    int n = snprintf(buff, sizeof(buff),
+                            (i + 1 < len && isdigit((unsigned char)s[i + 1]))
+                            ? "\\%03d" : "\\%d", c);
+                    addbytes(L, b, buff, n);
+                }
+                else
+                    addbytes(L, b, (const char *)&s[i], 1);
+            }
+            addbytes(L, b, "\"", 1);
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, arg)) {
+                lua_Integer n = lua_tointeger(L, arg);
+                len = snprintf(buff, sizeof(buff), (n == LUA_MININTEGER)
+                        ? "0x%" LUA_INTEGER_FRMLEN "x" : LUA_INTEGER_FMT,
+                        (LUAI_UACINT)n);
+            }
+            else {
+                lua_Number n = lua_tonumber(L, arg);
+                if (n == (lua_Number)HUGE_VAL)
+                    len = snprintf(buff, sizeof(buff), "1e9999");
+                else if (n == -(lua_Number)HUGE_VAL)
+                    len = snprintf(buff, sizeof(buff), "-1e9999");
+                else if (n != n)
+                    len = snprintf(buff, sizeof(buff), "(0/0)");
+                else
+                    len = snprintf(buff, sizeof(buff), "%a",
+                            (LUAI_UACNUMBER)n);
+            }
+            addbytes(L, b, buff, len);
+            break;
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+            s = luaL_tolstring(L, arg, &len);
+            addbytes(L, b, s, len);
+            lua_pop(L, 1);
+            break;
+        default:
+            luaL_argerror(L, arg, "value has no literal form");
+    }
+}
+
+/* b:appendf(fmt, ...): append string.format(fmt, ...); return 'b' */
+static int appendfbuffer (lua_State *L) {
+    StrBuffer *b = checkbuffer(L);
+    size_t lfmt, len;
+    const char *fmt = luaL_checklstring(L, 2, &lfmt);
+    const char *end = fmt + lfmt, *q, *s;
+    char form[MAX_FORMAT];
+    int arg = 2, top = lua_gettop(L);
+
+    reservebuffer(L, b, 0); /* check that it is not closed */
+    while (fmt < end) {
+        if (*fmt != '%') { /* copy up to the next '%' */
+            q = (const char *)memchr(fmt, '%', end - fmt);
+            if (q == NULL)
+                q = end;
+            addbytes(L, b, fmt, q - fmt);
+            fmt = q;
+            continue;
+        }
+        if (++fmt < end && *fmt == '%') {
+            addbytes(L, b, "%", 1);
+            fmt++;
+            continue;
+        }
+        if (++arg > top)
+            return luaL_argerror(L, arg, "no value");
+        switch (fmt[strspn(fmt, FMT_FLAGS "0123456789.")]) {
+            case 'd': case 'i':
+                scanformat(L, &fmt, form, LUA_INTEGER_FRMLEN, FMT_FLAGSI, 1);
+                goto intcase;
+            case 'u':
+                scanformat(L, &fmt, form, LUA_INTEGER_FRMLEN, FMT_FLAGSU, 1);
+                goto intcase;
+            case 'o': case 'x': case 'X':
+                scanformat(L, &fmt, form, LUA_INTEGER_FRMLEN, FMT_FLAGSX, 1);
+            intcase:
+                addformatted(L, b, form,
+                        (LUAI_UACINT)luaL_checkinteger(L, arg));
+                break;
+            case 'c':
+                scanformat(L, &fmt, form, "", FMT_FLAGSC, 0);
+                addformatted(L, b, form, (int)luaL_checkinteger(L, arg));
+                break;
+            case 'a': case 'A': case 'e': case 'E': case 'f':
+            case 'g': case 'G':
+                scanformat(L, &fmt, form, "", FMT_FLAGSF, 1);
+                addformatted(L, b, form,
+                        (LUAI_UACNUMBER)luaL_checknumber(L, arg));
+                break;
+            case 's':
+                scanformat(L, &fmt, form, "", FMT_FLAGSC, 1);
+                s = luaL_tolstring(L, arg, &len);
+                if (form[2] == '\0') /* no modifiers? */
+                    addbytes(L, b, s, len);
+                else {
+                    luaL_argcheck(L, len == strlen(s), arg,
+                            "string contains zeros");
+                    addformatted(L, b, form, s);
+                }
+                lua_pop(L, 1);
+                break;
+            case 'q':
+                scanformat(L, &fmt, form, "", FMT_FLAGS, 1);
+                if (form[2] != '\0')
+                    return luaL_error(L,
+                            "specifier '%%q' cannot have modifiers");
+                addquoted(L, b, arg);
+                break;
+            default:
+                scanformat(L, &fmt, form, "", FMT_FLAGS, 1);
+                return luaL_error(L, "invalid conversion '%s' to 'appendf'",
+                        form);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
 #endif
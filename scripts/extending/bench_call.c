@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "extending_lib.h"
+
+/* time N calls of 'f' (from conf.lua) through each calling interface:
+       ./bench_call 1000000 */
+
+static double elapsed (clock_t t0) {
+    return (double)(clock() - t0) / CLOCKS_PER_SEC;
+}
+
+int main (int argc, char *argv[]) {
+    int i, n = (argc > 1) ? atoi(argv[1]) : 1000000;
+    double *x = malloc(n * sizeof(double));
+    double *y = malloc(n * sizeof(double));
+    double *z = malloc(n * sizeof(double));
+    double sum, t;
+    clock_t t0;
+    struct PreparedCall pc;
+    lua_State *L = luaL_newstate();
+
+    if (L == NULL || x == NULL || y == NULL || z == NULL) {
+        puts("not enough memory");
+        exit(1);
+    }
+    luaL_openlibs(L);
+    _load(L, "conf.lua");
+    for (i = 0; i < n; i++) {
+        x[i] = 2.0 + i % 100;
+        y[i] = i * 0.001;
+    }
+
+    t0 = clock();
+    for (sum = 0, i = 0; i < n; i++) {
+        call_va(L, "f", "dd>d", x[i], y[i], &z[i]);
+        lua_pop(L, 1);
+        sum += z[i];
+    }
+    t = elapsed(t0);
+    printf("%-14s %8.3fs %12.0f calls/s  (sum %g)\n", "call_va", t, n / t, sum);
+
+    call_prepare(L, &pc, "f", "dd>d");
+    t0 = clock();
+    for (sum = 0, i = 0; i < n; i++) {
+        call_prepared(L, &pc, x[i], y[i], &z[i]);
+        lua_pop(L, pc.nres);
+        sum += z[i];
+    }
+    t = elapsed(t0);
+    printf("%-14s %8.3fs %12.0f calls/s  (sum %g)\n", "call_prepared", t,
+            n / t, sum);
+
+    t0 = clock();
+    call_batch(L, &pc, n, x, y, z);
+    for (sum = 0, i = 0; i < n; i++)
+        sum += z[i];
+    t = elapsed(t0);
+    printf("%-14s %8.3fs %12.0f calls/s  (sum %g)\n", "call_batch", t,
+            n / t, sum);
+
+    call_release(L, &pc);
+    lua_close(L);
+    free(x); free(y); free(z);
+    return 0;
+}
@@ -175,3 +175,151 @@ void call_va (lua_State *L, const char *func,
     //
     va_end(vl);
 }
+
+
+/* copy the type codes of 'sig' up to 'stop' into 'codes' */
+static int sigcodes (lua_State *L, const char **sig, char *codes,
+        char stop) {
+    int n;
+    for (n = 0; **sig && **sig != stop; n++) {
+        char c = *(*sig)++;
+        if (c != 'd' && c != 'i' && c != 's')
+            error(L, "invalid option (%c)", c);
+        if (n == CALL_MAXARGS)
+            error(L, "too many arguments or results");
+        codes[n] = c;
+    }
+    return n;
+}
+
+/*
+** Parse 'sig' and look 'func' up once: the function is anchored in the
+** registry, so it stays callable even if the global changes later.
+*/
+void call_prepare (lua_State *L, struct PreparedCall *pc,
+        const char *func, const char *sig) {
+    pc->narg = sigcodes(L, &sig, pc->args, '>');
+    if (*sig == '>') sig++; /* skip end of arguments */
+    pc->nres = sigcodes(L, &sig, pc->res, '>');
+    if (*sig)
+        error(L, "invalid option (%c)", *sig);
+
+    lua_getglobal(L, func);
+    if (!lua_isfunction(L, -1))
+        error(L, "'%s' is not a function", func);
+    pc->ref = luaL_ref(L, LUA_REGISTRYINDEX); /* pops the function */
+    snprintf(pc->name, sizeof(pc->name), "%s", func);
+}
+
+/* do the call; the function and its arguments are on the stack */
+static void docall (lua_State *L, const struct PreparedCall *pc) {
+    if (lua_pcall(L, pc->narg, pc->nres, 0) != LUA_OK)
+        error(L, "error calling '%s': %s", pc->name,
+                lua_tostring(L, -1));
+}
+
+/*
+** Same as 'call_va', for a prepared call. As there, the results stay on
+** the stack (so that string results remain valid); the caller pops
+** them with 'lua_pop(L, pc->nres)'.
+*/
+void call_prepared (lua_State *L, const struct PreparedCall *pc, ...) {
+    va_list vl;
+    int i;
+
+    va_start(vl, pc);
+    luaL_checkstack(L, pc->narg + 1, "too many arguments");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, pc->ref); /* push function */
+    for (i = 0; i < pc->narg; i++) {
+        switch (pc->args[i]) {
+            case 'd': lua_pushnumber(L, va_arg(vl, double)); break;
+            case 'i': lua_pushinteger(L, va_arg(vl, int)); break;
+            default: lua_pushstring(L, va_arg(vl, char *)); break;
+        }
+    }
+    docall(L, pc);
+
+    for (i = 0; i < pc->nres; i++) {
+        int idx = i - pc->nres; /* stack index of result */
+        int isnum = 1;
+        switch (pc->res[i]) {
+            case 'd':
+                *va_arg(vl, double *) = lua_tonumberx(L, idx, &isnum);
+                break;
+            case 'i':
+                *va_arg(vl, int *) = (int)lua_tointegerx(L, idx, &isnum);
+                break;
+            default: {
+                const char *s = lua_tostring(L, idx);
+                isnum = (s != NULL);
+                *va_arg(vl, const char **) = s;
+                break;
+            }
+        }
+        if (!isnum)
+            error(L, "wrong result type");
+    }
+    va_end(vl);
+}
+
+/*
+** Call a prepared function 'n' times, in one loop. After 'n' come one
+** array per argument ('const double *', 'const int *' or
+** 'const char **', each with 'n' entries) and then one array per
+** result ('double *' or 'int *'); the i-th call takes the i-th entry
+** of each argument array and stores into the i-th entry of each result
+** array. Results are popped after each call, so they cannot be strings.
+*/
+void call_batch (lua_State *L, const struct PreparedCall *pc, int n, ...) {
+    va_list vl;
+    const void *in[CALL_MAXARGS];
+    void *out[CALL_MAXARGS];
+    int i, k;
+
+    va_start(vl, n);
+    for (k = 0; k < pc->narg; k++)
+        in[k] = va_arg(vl, const void *);
+    for (k = 0; k < pc->nres; k++) {
+        if (pc->res[k] == 's')
+            error(L, "cannot batch '%s': string result", pc->name);
+        out[k] = va_arg(vl, void *);
+    }
+    va_end(vl);
+
+    luaL_checkstack(L, pc->narg + 1, "too many arguments");
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pc->ref); /* push function */
+        for (k = 0; k < pc->narg; k++) {
+            switch (pc->args[k]) {
+                case 'd':
+                    lua_pushnumber(L, ((const double *)in[k])[i]);
+                    break;
+                case 'i':
+                    lua_pushinteger(L, ((const int *)in[k])[i]);
+                    break;
+                default:
+                    lua_pushstring(L, ((const char *const *)in[k])[i]);
+                    break;
+            }
+        }
+        docall(L, pc);
+
+        for (k = 0; k < pc->nres; k++) {
+            int idx = k - pc->nres; /* stack index of result */
+            int isnum;
+            if (pc->res[k] == 'd')
+                ((double *)out[k])[i] = lua_tonumberx(L, idx, &isnum);
+            else
+                ((int *)out[k])[i] = (int)lua_tointegerx(L, idx, &isnum);
+            if (!isnum)
+                error(L, "wrong result type");
+        }
+        lua_pop(L, pc->nres); /* pop results */
+    }
+}
+
+/* free the registry entry of a prepared call */
+void call_release (lua_State *L, struct PreparedCall *pc) {
+    luaL_unref(L, LUA_REGISTRYINDEX, pc->ref);
+    pc->ref = LUA_NOREF;
+}
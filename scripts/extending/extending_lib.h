@@ -18,6 +18,27 @@ void setcolor (lua_State *L, struct ColorTable *ct);
 double f (lua_State *L, double x, double y);
 void call_va (lua_State *L, const char *func, const char *sig, ...);
 
+/*
+** A call prepared by 'call_prepare': the signature (same codes as
+** 'call_va') already parsed and the function kept in the registry, so
+** that each call does neither.
+*/
+#define CALL_MAXARGS 16 /* maximum number of arguments or results */
+
+struct PreparedCall {
+    int ref; /* function, as a reference in the registry */
+    int narg, nres; /* number of arguments and results */
+    char args[CALL_MAXARGS]; /* type of each argument ('d', 'i', 's') */
+    char res[CALL_MAXARGS]; /* type of each result */
+    char name[32]; /* function name, for error messages */
+};
+
+void call_prepare (lua_State *L, struct PreparedCall *pc,
+        const char *func, const char *sig);
+void call_prepared (lua_State *L, const struct PreparedCall *pc, ...);
+void call_batch (lua_State *L, const struct PreparedCall *pc, int n, ...);
+void call_release (lua_State *L, struct PreparedCall *pc);
+
 
 static void stackDump (lua_State *L) {
     int i;
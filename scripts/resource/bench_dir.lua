@@ -0,0 +1,39 @@
+-- time the ways of listing a (big) directory:
+--     lua bench_dir.lua /path/to/dir
+local dir = require "dir"
+
+local path = arg and arg[1] or "."
+
+local function run (name, options)
+    local n = 0
+    local t0 = os.clock()
+    if options and options.batch then
+        for names in dir.open(path, options) do n = n + #names end
+    else
+        for name in dir.open(path, options) do n = n + 1 end
+    end
+    print(string.format("%-24s %8d entries %7.3fs", name, n, os.clock() - t0))
+end
+
+run("names")
+run("names, batch 1024", {batch = 1024})
+run("types", {type = true})
+run("types, batch 1024", {batch = 1024, type = true})
+run("stat", {stat = true})
+run("stat, batch 1024", {batch = 1024, stat = true})
+
+-- what a caller had to do before: build each path and ask for the size
+do
+    local n = 0
+    local t0 = os.clock()
+    for name in dir.open(path) do
+        local f = io.open(path .. "/" .. name)
+        if f then
+            local size = f:seek("end")
+            f:close()
+        end
+        n = n + 1
+    end
+    print(string.format("%-24s %8d entries %7.3fs", "names + io.open/seek", n,
+            os.clock() - t0))
+end
@@ -0,0 +1,98 @@
+-- measure how many events per second lxp delivers:
+--     lua bench_expat.lua 200000
+-- the document is generated in memory and fed in 64 KB pieces
+local lxp = require "lxp"
+
+local N = tonumber(arg and arg[1]) or 100000 -- number of records
+
+local parts = {"<feed>\n"}
+for i = 1, N do
+    parts[#parts + 1] = string.format(
+        '<item id="%d" kind="k%d" lang="en"><title>Title %d</title>' ..
+        '<price currency="EUR">%d.%02d</price>' ..
+        '<desc>first line &amp; more\nsecond line &lt;%d&gt;\n' ..
+        'third line</desc></item>\n',
+        i, i % 7, i, i % 1000, i % 100, i)
+end
+parts[#parts + 1] = "</feed>\n"
+local doc = table.concat(parts)
+
+local CHUNK = 64 * 1024
+
+local function run (name, callbacks, options)
+    local events = 0
+    local function count () events = events + 1 end
+    local cb = {}
+    for k in pairs(callbacks) do cb[k] = count end
+
+    local p = lxp.new(cb, options)
+    local t0 = os.clock()
+    for i = 1, #doc, CHUNK do
+        assert(p:parse(string.sub(doc, i, i + CHUNK - 1)))
+    end
+    assert(p:parse())
+    local t = os.clock() - t0
+    p:close()
+
+    print(string.format("%-28s %9d events %7.3fs %10.0f events/s",
+            name, events, t, events / t))
+end
+
+print(string.format("document: %d records, %.1f MB", N, #doc / 2^20))
+run("all handlers", {StartElement = 1, EndElement = 1, CharacterData = 1})
+run("all, reused attributes",
+    {StartElement = 1, EndElement = 1, CharacterData = 1},
+    {reuseattributes = true})
+run("all, coalesced text",
+    {StartElement = 1, EndElement = 1, CharacterData = 1},
+    {coalesce = true})
+-- the same events, pulled with an iterator
+do
+    local events = 0
+    local p = lxp.new({})
+    local t0 = os.clock()
+    for i = 1, #doc, CHUNK do
+        for kind in p:events(string.sub(doc, i, i + CHUNK - 1)) do
+            events = events + 1
+        end
+    end
+    for kind in p:events() do events = events + 1 end
+    local t = os.clock() - t0
+    p:close()
+    print(string.format("%-28s %9d events %7.3fs %10.0f events/s",
+            "events iterator", events, t, events / t))
+end
+run("elements only", {StartElement = 1, EndElement = 1})
+run("StartElement only", {StartElement = 1})
+run("elements, interned names", {StartElement = 1, EndElement = 1},
+    {intern = true})
+run("elements, namespaces", {StartElement = 1, EndElement = 1},
+    {separator = "|", intern = true})
+
+-- whole-file ingestion: line by line (as in demo_expat.lua) against
+-- 'parsefile', with a single handler
+local fname = os.tmpname()
+local f = assert(io.open(fname, "w"))
+f:write(doc)
+f:close()
+
+local function ingest (name, feed)
+    local elements = 0
+    local p = lxp.new({StartElement = function () elements = elements + 1 end})
+    local t0 = os.clock()
+    feed(p)
+    local t = os.clock() - t0
+    p:close()
+    assert(elements == 4 * N + 1)
+    print(string.format("%-28s %7.3fs %8.1f MB/s", name, t, #doc / 2^20 / t))
+end
+
+ingest("io.lines + parse", function (p)
+    for l in io.lines(fname) do
+        assert(p:parse(l))
+        assert(p:parse("\n"))
+    end
+    assert(p:parse())
+end)
+ingest("parsefile", function (p) assert(p:parsefile(fname)) end)
+os.remove(fname)
@@ -0,0 +1,37 @@
+-- count the entries of a tree; run it under 'time':
+--     time lua bench_walk.lua /usr 0    (recursion in Lua, dir.open)
+--     time lua bench_walk.lua /usr 4    (dir.walk, 4 threads)
+local dir = require "dir"
+
+local root = arg and arg[1] or "."
+local T = tonumber(arg and arg[2]) or 4
+
+local n, bytes = 0, 0
+
+local function walk (path)
+    for names, types, sizes in dir.open(path, {batch = 1024, stat = true}) do
+        for i = 1, #names do
+            local name = names[i]
+            if name ~= "." and name ~= ".." then
+                n = n + 1
+                bytes = bytes + math.max(sizes[i], 0)
+                if types[i] == "directory" then
+                    walk(path .. "/" .. name)
+                end
+            end
+        end
+    end
+end
+
+if T == 0 then
+    walk(root)
+else
+    for paths, types, sizes in dir.walk(root, {threads = T, batch = 1024,
+            stat = true}) do
+        n = n + #paths
+        for i = 1, #sizes do bytes = bytes + math.max(sizes[i], 0) end
+    end
+end
+
+print(string.format("%d entries, %.1f MB, %s", n, bytes / 2^20,
+        T == 0 and "Lua recursion" or T .. " threads"))
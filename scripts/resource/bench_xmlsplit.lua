@@ -0,0 +1,44 @@
+-- compare sequential parsing with 'xmlsplit'; run it under 'time':
+--     time lua bench_xmlsplit.lua 200000 0    (sequential)
+--     time lua bench_xmlsplit.lua 200000 4    (4 workers)
+local lxp = require "lxp"
+local lproc = require "lproc"
+local xmlsplit = require "xmlsplit"
+
+local N = tonumber(arg and arg[1]) or 100000 -- number of records
+local W = tonumber(arg and arg[2]) or 4 -- workers (0: sequential)
+
+local parts = {"<feed>\n"}
+for i = 1, N do
+    parts[#parts + 1] = string.format(
+        '<item id="%d"><title>Title %d</title>' ..
+        '<price currency="EUR">%d.%02d</price></item>\n',
+        i, i, i % 1000, i % 100)
+end
+parts[#parts + 1] = "</feed>\n"
+local doc = table.concat(parts)
+
+-- collect the id of every item
+local function setup ()
+    local ids = {}
+    local cb = {StartElement = function (p, name, attrs)
+        if name == "item" then ids[#ids + 1] = attrs.id end
+    end}
+    return cb, function () return ids end
+end
+
+local ids
+if W == 0 then
+    local cb, collect = setup()
+    local p = lxp.new(cb)
+    assert(p:parse(doc))
+    assert(p:parse())
+    p:close()
+    ids = collect()
+else
+    ids = xmlsplit.parse(doc, "item", setup, {workers = W})
+end
+
+assert(#ids == N and ids[N] == tostring(N))
+print(string.format("%d records, %.1f MB, %s", N, #doc / 2^20,
+        W == 0 and "sequential" or W .. " workers"))
@@ -5,3 +5,22 @@ for fname in dir.open(".") do
     print(fname)
 end
 
+
+-- entries in batches, with their types and sizes
+for names, types, sizes in dir.open(".", {batch = 256, stat = true}) do
+    for i = 1, #names do
+        print(names[i], types[i], sizes[i])
+    end
+end
+
+-- changes since the watch was created (Linux only); 'events' waits up
+-- to the given number of seconds for the first one
+local w = dir.watch(".", {delay = 0.05})
+io.open("demo_dir.tmp", "w"):close()
+os.remove("demo_dir.tmp")
+io.open("demo_dir.tmp", "w"):close()
+for name, event in w:events(1) do
+    print(name, event) -- just "demo_dir.tmp create"
+end
+os.remove("demo_dir.tmp")
+w:close()
@@ -3,6 +3,9 @@
 
 static const struct luaL_Reg lxp_meths[] = {
     {"parse", lxp_parse},
+    {"parsefile", lxp_parsefile},
+    {"events", lxp_events},
+    {"skip", lxp_skip},
     {"close", lxp_close},
     {"__gc", lxp_close},
     {NULL, NULL}
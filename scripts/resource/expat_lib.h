@@ -2,7 +2,12 @@
 #define EXPAT_LIB_H
 
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "expat.h"
 #include "lua.h"
 #include "lauxlib.h"
@@ -10,46 +15,264 @@
 typedef struct lxp_userdata {
     XML_Parser parser; /* associated expat parser */
     lua_State *L;
+    int reuseattrs; /* pass the same attribute table to all elements? */
+    char *text; /* pending character data (NULL if not coalescing) */
+    size_t textlen, textsize;
+    /* pull mode ('events'): */
+    lua_State *events; /* queued events, 3 slots each (NULL until used) */
+    int head; /* index of the first queued event in 'events' */
+    int pulling; /* 0: idle; 1: chunk not started; 2: suspended */
+    int skipdepth; /* > 0 while skipping a subtree */
+    const char *chunk; /* current chunk (kept alive by the iterator) */
+    size_t chunklen;
+    int intern; /* intern element and attribute names? */
+    struct NameEntry **names; /* interned names */
+    size_t nbuckets, nnames;
 } lxp_userdata;
 
+#define LXP_TEXTSIZE (64 * 1024) /* default size for coalesced text */
+#define LXP_READSIZE (256 * 1024) /* bytes read at a time by 'parsefile' */
+
+/* stack slots while parsing: the handlers are looked up once per
+   'parse' call, not once per event */
+#define CALLBACKS_IDX 3
+#define START_IDX 4 /* StartElement */
+#define END_IDX 5 /* EndElement */
+#define CHARDATA_IDX 6 /* CharacterData */
+#define ATTRS_IDX 7 /* reused attribute table (if any) */
+
 /* forward declarations for callback functions */
 static void f_StartElement (void *ud,
         const char *name,
         const char **atts);
 static void f_CharData (void *ud, const char *s, int len);
 static void f_EndElement (void *ud, const char *name);
+static void flushtext (lxp_userdata *xpu);
+
+/*
+** Name cache. Documents repeat the same few names over and over, so
+** each parser keeps a registry reference to the Lua string for every
+** name it has seen, found by a hash computed over the C string.
+*/
+
+typedef struct NameEntry {
+    struct NameEntry *next;
+    unsigned int hash;
+    size_t len;
+    int ref; /* the Lua string in the registry */
+    char name[1]; /* variable part */
+} NameEntry;
+
+#define MIN_NAME_BUCKETS 64 /* must be a power of 2 */
+#define MAX_NAMES 4096 /* names beyond this are not interned */
+
+static int grownames (lxp_userdata *xpu) {
+    size_t newsize = (xpu->nbuckets == 0) ? MIN_NAME_BUCKETS
+                                          : 2 * xpu->nbuckets;
+    NameEntry **newnames = (NameEntry **)calloc(newsize,
+            sizeof(NameEntry *));
+    size_t i;
+
+    if (newnames == NULL)
+        return 0;
+    for (i = 0; i < xpu->nbuckets; i++) { /* rehash all names */
+        NameEntry *e = xpu->names[i];
+        while (e != NULL) {
+            NameEntry *next = e->next;
+            NameEntry **bucket = &newnames[e->hash & (newsize - 1)];
+            e->next = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(xpu->names);
+    xpu->names = newnames;
+    xpu->nbuckets = newsize;
+    return 1;
+}
+
+/* push the Lua string for 'name', interning it if it is new */
+static void pushname (lua_State *L, lxp_userdata *xpu, const char *name) {
+    unsigned int h = 2166136261u; /* FNV-1a */
+    const char *c;
+    size_t len;
+    NameEntry *e;
+
+    if (!xpu->intern) {
+        lua_pushstring(L, name);
+        return;
+    }
+
+    for (c = name; *c; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619u;
+    }
+    len = (size_t)(c - name);
+
+    if (xpu->nbuckets > 0) {
+        for (e = xpu->names[h & (xpu->nbuckets - 1)]; e; e = e->next) {
+            if (e->hash == h && e->len == len &&
+                    memcmp(e->name, name, len) == 0) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);
+                return;
+            }
+        }
+    }
+
+    lua_pushlstring(L, name, len);
+    if (xpu->nnames >= MAX_NAMES) /* cache is full? */
+        return;
+    if (xpu->nnames >= xpu->nbuckets && !grownames(xpu))
+        return;
+    e = (NameEntry *)malloc(sizeof(NameEntry) + len);
+    if (e == NULL)
+        return; /* just not interned */
+    e->hash = h;
+    e->len = len;
+    memcpy(e->name, name, len + 1);
+    lua_pushvalue(L, -1);
+    e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    e->next = xpu->names[h & (xpu->nbuckets - 1)];
+    xpu->names[h & (xpu->nbuckets - 1)] = e;
+    xpu->nnames++;
+}
+
+static void freenames (lua_State *L, lxp_userdata *xpu) {
+    size_t i;
+
+    for (i = 0; i < xpu->nbuckets; i++) {
+        NameEntry *e = xpu->names[i];
+        while (e != NULL) {
+            NameEntry *next = e->next;
+            luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+            free(e);
+            e = next;
+        }
+    }
+    free(xpu->names);
+    xpu->names = NULL;
+    xpu->nbuckets = xpu->nnames = 0;
+}
+
+/* fill the attribute table on the top of the stack */
+static void setattributes (lua_State *L, lxp_userdata *xpu,
+        const char **atts) {
+    for (; *atts; atts += 2) {
+        pushname(L, xpu, *atts);
+        lua_pushstring(L, *(atts + 1));
+        lua_rawset(L, -3); /* table[*atts] = *(atts+1) */
+    }
+}
+
 
+/* lxp.new(callbacks [, options]); option 'reuseattributes' makes
+   all StartElement calls get the same (cleared) attribute table;
+   option 'coalesce' (true or a size in bytes) joins contiguous
+   character data into a single CharacterData call; option 'separator'
+   (one character) makes the parser namespace aware, with names given
+   as "uri<separator>localname"; option 'intern' caches the strings
+   for element and attribute names */
 static int lxp_make_parser (lua_State *L) {
     XML_Parser p;
+    lxp_userdata *xpu;
+    int reuse;
+    lua_Integer textsize = 0;
+    const char *sep = NULL;
+    int intern = 0;
 
-    /* (1) create a parser object */
-    lxp_userdata *xpu = (lxp_userdata *)lua_newuserdata(L,
-            sizeof(lxp_userdata));
+    /* (0) check the arguments before creating anything */
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 2))
+        luaL_checktype(L, 2, LUA_TTABLE);
+    reuse = !lua_isnoneornil(L, 2) &&
+        lua_getfield(L, 2, "reuseattributes") != LUA_TNIL &&
+        lua_toboolean(L, -1);
+    if (!lua_isnoneornil(L, 2)) {
+        int t = lua_getfield(L, 2, "coalesce");
+        if (t == LUA_TNUMBER) {
+            textsize = lua_tointeger(L, -1);
+            luaL_argcheck(L, textsize > 0, 2, "invalid 'coalesce' size");
+        }
+        else if (lua_toboolean(L, -1))
+            textsize = LXP_TEXTSIZE;
+        intern = lua_getfield(L, 2, "intern") != LUA_TNIL &&
+            lua_toboolean(L, -1);
+        if (lua_getfield(L, 2, "separator") != LUA_TNIL) {
+            sep = lua_tostring(L, -1);
+            luaL_argcheck(L, sep != NULL && sep[0] != '\0' && sep[1] == '\0',
+                    2, "'separator' must be a single character");
+        }
+    }
+
+    /* (1) create a parser object (user values: callbacks, the
+       reused attribute table and the event queue) */
+    xpu = (lxp_userdata *)lua_newuserdatauv(L,
+            sizeof(lxp_userdata), 3);
     /* pre-initialize it, in case of error */
     xpu->parser = NULL;
+    xpu->reuseattrs = reuse;
+    xpu->text = NULL;
+    xpu->textlen = 0;
+    xpu->textsize = (size_t)textsize;
+    xpu->events = NULL;
+    xpu->pulling = 0;
+    xpu->skipdepth = 0;
+    xpu->intern = intern;
+    xpu->names = NULL;
+    xpu->nbuckets = xpu->nnames = 0;
     /* set its metatable */
     luaL_getmetatable(L, "Expat");
     lua_setmetatable(L, -2);
 
     /* (2) create the Expat parser */
-    p = xpu->parser = XML_ParserCreate(NULL);
+    p = xpu->parser = (sep != NULL) ? XML_ParserCreateNS(NULL, sep[0])
+                                    : XML_ParserCreate(NULL);
     if (!p)
         luaL_error(L, "XML_ParserCreate failed");
 
-    /* (3) check and store the callback table */
-    luaL_checktype(L, 1, LUA_TTABLE);
+    if (textsize > 0 && (xpu->text = (char *)malloc(textsize)) == NULL)
+        luaL_error(L, "not enough memory for text buffer");
+
+    /* (3) store the callback table */
     lua_pushvalue(L, 1); /* push table */
-    lua_setuservalue(L, -2); /* set it as the user value */
+    lua_setiuservalue(L, -2, 1); /* set it as the user value */
 
-    /* (4) configure Expat parser */
+    if (reuse) {
+        lua_newtable(L);
+        lua_setiuservalue(L, -2, 2);
+    }
+
+    /* (4) configure Expat parser; handlers are set by 'parse' */
     XML_SetUserData(p, xpu);
-    XML_SetElementHandler(p, f_StartElement, f_EndElement);
-    XML_SetCharacterDataHandler(p, f_CharData);
 
     return 1;
 }
 
 
+/* put callback table at stack index 3, and its handlers above it;
+   the parser is at index 1 and index 2 is left alone */
+static void sethandlers (lua_State *L, lxp_userdata *xpu) {
+    int coalesce;
+
+    lua_settop(L, 2);
+    lua_getiuservalue(L, 1, 1);
+    lua_getfield(L, CALLBACKS_IDX, "StartElement");
+    lua_getfield(L, CALLBACKS_IDX, "EndElement");
+    lua_getfield(L, CALLBACKS_IDX, "CharacterData");
+    lua_getiuservalue(L, 1, 2); /* attribute table (or nil) */
+    xpu->L = L; /* set Lua state */
+
+    /* events without a handler are not even reported by Expat, except
+       element boundaries, which flush coalesced text */
+    coalesce = xpu->text != NULL && !lua_isnil(L, CHARDATA_IDX);
+    XML_SetElementHandler(xpu->parser,
+            (coalesce || !lua_isnil(L, START_IDX)) ? f_StartElement : NULL,
+            (coalesce || !lua_isnil(L, END_IDX)) ? f_EndElement : NULL);
+    XML_SetCharacterDataHandler(xpu->parser,
+            lua_isnil(L, CHARDATA_IDX) ? NULL : f_CharData);
+}
+
+
 static int lxp_parse (lua_State *L) {
     int status;
     size_t len;
@@ -65,75 +288,389 @@ static int lxp_parse (lua_State *L) {
     /* get second argument (a string) */
     s = luaL_optlstring(L, 2, NULL, &len);
 
-    /* put callback table at stack index 3 */
-    lua_settop(L, 2);
-    lua_getuservalue(L, 1);
-    xpu->L = L; /* set Lua state */
+    sethandlers(L, xpu);
 
     /* call Expat to parse string */
     status = XML_Parse(xpu->parser, s, (int)len, s == NULL);
+    if (status && s == NULL) /* end of document? */
+        flushtext(xpu);
 
     /* return error code */
     lua_pushboolean(L, status);
     return 1;
 }
 
+static void callchardata (lua_State *L, const char *s, size_t len) {
+    lua_pushvalue(L, CHARDATA_IDX); /* handler */
+    lua_pushvalue(L, 1); /* push the parser ('self') */
+    lua_pushlstring(L, s, len); /* push Char data */
+    lua_call(L, 2, 0); /* call the handler */
+}
+
+/* deliver the coalesced character data, if any */
+static void flushtext (lxp_userdata *xpu) {
+    size_t n = xpu->textlen;
+
+    if (n == 0)
+        return;
+    xpu->textlen = 0; /* empty it first, in case the handler fails */
+    if (!lua_isnil(xpu->L, CHARDATA_IDX)) /* still has a handler? */
+        callchardata(xpu->L, xpu->text, n);
+}
+
 static void f_CharData (void *ud, const char *s, int len) {
     lxp_userdata *xpu = (lxp_userdata *)ud;
-    lua_State *L = xpu->L;
 
-    /* get handler from callback table */
-    lua_getfield(L, 3, "CharacterData");
-    if (lua_isnil(L, -1)) { /* no handler? */
-        lua_pop(L, 1);
+    if (xpu->text != NULL) { /* coalescing? */
+        if (xpu->textlen + len > xpu->textsize) { /* does not fit? */
+            flushtext(xpu);
+            if ((size_t)len >= xpu->textsize) { /* too large to keep */
+                callchardata(xpu->L, s, len);
+                return;
+            }
+        }
+        memcpy(xpu->text + xpu->textlen, s, len);
+        xpu->textlen += len;
         return;
     }
 
-    lua_pushvalue(L, 1); /* push the parser ('self') */
-    lua_pushlstring(L, s, len); /* push Char data */
-    lua_call(L, 2, 0); /* call the handler */
+    callchardata(xpu->L, s, len);
 }
 
 static void f_EndElement (void *ud, const char *name) {
     lxp_userdata *xpu = (lxp_userdata *)ud;
     lua_State *L = xpu->L;
 
-    lua_getfield(L, 3, "EndElement");
-    if (lua_isnil(L, -1)) { /* no handler? */
-        lua_pop(L, 1);
+    flushtext(xpu);
+    if (lua_isnil(L, END_IDX)) /* only here to flush the text? */
         return;
-    }
 
+    lua_pushvalue(L, END_IDX); /* handler */
     lua_pushvalue(L, 1); /* push the parser ('self') */
-    lua_pushstring(L, name); /* push tag name */
+    pushname(L, xpu, name); /* push tag name */
     lua_call(L, 2, 0); /* call the handler */
 }
 
+/* remove all entries from the table on the top of the stack */
+static void cleartable (lua_State *L) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1); /* keep the key */
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, -4); /* table[key] = nil */
+    }
+}
+
 static void f_StartElement (void *ud,
         const char *name,
         const char **atts) {
     lxp_userdata *xpu = (lxp_userdata *)ud;
     lua_State *L = xpu->L;
 
-    lua_getfield(L, 3, "StartElement");
-    if (lua_isnil(L, -1)) { /* no handler? */
-        lua_pop(L, 1);
+    flushtext(xpu);
+    if (lua_isnil(L, START_IDX)) /* only here to flush the text? */
         return;
-    }
 
+    lua_pushvalue(L, START_IDX); /* handler */
     lua_pushvalue(L, 1); /* push the parser ('self') */
-    lua_pushstring(L, name); /* push tag name */
+    pushname(L, xpu, name); /* push tag name */
 
-    /* create and fill the attribute table */
-    lua_newtable(L);
-    for (; *atts; atts += 2) {
-        lua_pushstring(L, *(atts + 1));
-        lua_setfield(L, -2, *atts); /* table[*atts] = *(atts+1) */
+    /* get and fill the attribute table */
+    if (xpu->reuseattrs) {
+        lua_pushvalue(L, ATTRS_IDX);
+        cleartable(L);
+    }
+    else {
+        int n = 0;
+        while (atts[2 * n] != NULL)
+            n++;
+        lua_createtable(L, 0, n);
     }
+    setattributes(L, xpu, atts);
 
     lua_call(L, 3, 0); /* call the handler */
 }
 
+/* feed the file descriptor at index 2 (a light userdata) to Expat,
+   reading straight into its buffer; called in protected mode so
+   that 'lxp_parsefile' can close the file if a handler fails */
+static int parsefd (lua_State *L) {
+    lxp_userdata *xpu = (lxp_userdata *)lua_touserdata(L, 1);
+    int fd = (int)(intptr_t)lua_touserdata(L, 2);
+    ssize_t n;
+
+    sethandlers(L, xpu);
+    do {
+        void *buff = XML_GetBuffer(xpu->parser, LXP_READSIZE);
+        if (buff == NULL)
+            return luaL_error(L, "not enough memory for parse buffer");
+        while ((n = read(fd, buff, LXP_READSIZE)) < 0 && errno == EINTR)
+            ;
+        if (n < 0)
+            return luaL_error(L, "read error: %s", strerror(errno));
+        if (!XML_ParseBuffer(xpu->parser, (int)n, n == 0)) {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+    } while (n > 0);
+
+    flushtext(xpu); /* end of document */
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/* p:parsefile(path): parse a whole document from a file, without
+   creating Lua strings for its contents; return true, or false plus
+   an error message and line number for malformed XML */
+static int lxp_parsefile (lua_State *L) {
+    lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, "Expat");
+    const char *path = luaL_checkstring(L, 2);
+    int fd, status;
+
+    luaL_argcheck(L, xpu->parser != NULL, 1, "parser is closed");
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return luaL_fileresult(L, 0, path);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); /* just a hint */
+#endif
+
+    lua_pushcfunction(L, parsefd);
+    lua_pushvalue(L, 1); /* the parser ('self' for the handlers) */
+    lua_pushlightuserdata(L, (void *)(intptr_t)fd);
+    status = lua_pcall(L, 2, 1, 0);
+    close(fd);
+    if (status != LUA_OK)
+        return lua_error(L); /* propagate the handler's error */
+
+    if (lua_toboolean(L, -1))
+        return 1;
+
+    lua_pushstring(L, XML_ErrorString(XML_GetErrorCode(xpu->parser)));
+    lua_pushinteger(L, (lua_Integer)XML_GetCurrentLineNumber(xpu->parser));
+    return 3;
+}
+
+/*
+** Pull mode: 'p:events(chunk)' returns an iterator over the events in
+** 'chunk'. Handlers queue each event in a thread, as three values
+** (kind, name or text, attributes or nil), and suspend Expat once a
+** batch is queued; the iterator resumes it when the queue is empty.
+** Events are built on the running state, so that errors are raised
+** there, and then moved to the queue. Index 1 of the queue keeps the
+** reused attribute table (or nil).
+*/
+
+#define FIRST_EVENT 2
+#define EVENT_BATCH 64 /* events queued before suspending Expat */
+
+static int pendingevents (lxp_userdata *xpu) {
+    return lua_gettop(xpu->events) >= xpu->head;
+}
+
+/* move the event on the top of the running state to the queue */
+static void queueevent (lxp_userdata *xpu) {
+    lua_State *q = xpu->events;
+
+    if (!lua_checkstack(q, 4)) /* one spare for the attribute table */
+        luaL_error(xpu->L, "too many pending events");
+    lua_xmove(xpu->L, q, 3);
+    if (lua_gettop(q) - xpu->head >= 3 * EVENT_BATCH - 1)
+        XML_StopParser(xpu->parser, XML_TRUE); /* (fails if suspended) */
+}
+
+static void queuetext (lxp_userdata *xpu, const char *s, size_t len) {
+    lua_State *L = xpu->L;
+    lua_pushliteral(L, "text");
+    lua_pushlstring(L, s, len);
+    lua_pushnil(L);
+    queueevent(xpu);
+}
+
+static void queueflush (lxp_userdata *xpu) {
+    size_t n = xpu->textlen;
+    if (n > 0) {
+        xpu->textlen = 0;
+        if (xpu->skipdepth == 0)
+            queuetext(xpu, xpu->text, n);
+    }
+}
+
+static void ev_StartElement (void *ud, const char *name,
+        const char **atts) {
+    lxp_userdata *xpu = (lxp_userdata *)ud;
+    lua_State *L = xpu->L;
+
+    queueflush(xpu);
+    if (xpu->skipdepth > 0) { /* inside a skipped subtree? */
+        xpu->skipdepth++;
+        return;
+    }
+
+    lua_pushliteral(L, "start");
+    pushname(L, xpu, name);
+    if (xpu->reuseattrs) {
+        lua_pushvalue(xpu->events, 1);
+        lua_xmove(xpu->events, L, 1);
+        cleartable(L);
+    }
+    else {
+        int n = 0;
+        while (atts[2 * n] != NULL)
+            n++;
+        lua_createtable(L, 0, n);
+    }
+    setattributes(L, xpu, atts);
+    queueevent(xpu);
+}
+
+static void ev_EndElement (void *ud, const char *name) {
+    lxp_userdata *xpu = (lxp_userdata *)ud;
+    lua_State *L = xpu->L;
+
+    queueflush(xpu);
+    if (xpu->skipdepth > 0) { /* the end of the skipped subtree is */
+        xpu->skipdepth--;      /* skipped too */
+        return;
+    }
+
+    lua_pushliteral(L, "end");
+    pushname(L, xpu, name);
+    lua_pushnil(L);
+    queueevent(xpu);
+}
+
+static void ev_CharData (void *ud, const char *s, int len) {
+    lxp_userdata *xpu = (lxp_userdata *)ud;
+
+    if (xpu->skipdepth > 0)
+        return;
+    if (xpu->text != NULL) { /* coalescing? */
+        if (xpu->textlen + len > xpu->textsize) {
+            queueflush(xpu);
+            if ((size_t)len >= xpu->textsize) {
+                queuetext(xpu, s, len);
+                return;
+            }
+        }
+        memcpy(xpu->text + xpu->textlen, s, len);
+        xpu->textlen += len;
+        return;
+    }
+    queuetext(xpu, s, len);
+}
+
+
+static int nextevent (lua_State *L) {
+    lxp_userdata *xpu = (lxp_userdata *)lua_touserdata(L,
+            lua_upvalueindex(1));
+    lua_State *q = xpu->events;
+
+    for (;;) {
+        enum XML_Status status;
+
+        if (pendingevents(xpu)) { /* deliver the oldest event */
+            int i;
+            for (i = 0; i < 3; i++)
+                lua_pushvalue(q, xpu->head + i);
+            lua_xmove(q, L, 3);
+            xpu->head += 3;
+            if (!pendingevents(xpu)) { /* queue is empty? */
+                lua_settop(q, FIRST_EVENT - 1);
+                xpu->head = FIRST_EVENT;
+            }
+            return 3;
+        }
+
+        if (xpu->pulling == 0) /* chunk is over? */
+            return 0;
+        if (xpu->parser == NULL)
+            return luaL_error(L, "parser is closed");
+        xpu->L = L; /* handlers build the events here */
+
+        if (xpu->pulling == 1) /* first call for this chunk? */
+            status = XML_Parse(xpu->parser, xpu->chunk, (int)xpu->chunklen,
+                    xpu->chunk == NULL);
+        else
+            status = XML_ResumeParser(xpu->parser);
+
+        if (status == XML_STATUS_ERROR) {
+            xpu->pulling = 0;
+            return luaL_error(L, "%s at line %d",
+                    XML_ErrorString(XML_GetErrorCode(xpu->parser)),
+                    (int)XML_GetCurrentLineNumber(xpu->parser));
+        }
+        else if (status == XML_STATUS_SUSPENDED)
+            xpu->pulling = 2;
+        else { /* chunk consumed */
+            xpu->pulling = 0;
+            if (xpu->chunk == NULL) /* end of document? */
+                queueflush(xpu);
+        }
+    }
+}
+
+
+/* p:events([chunk]): iterate over the events in 'chunk' (no chunk
+   ends the document); each step returns "start", name, attributes,
+   or "end", name, or "text", data */
+static int lxp_events (lua_State *L) {
+    lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, "Expat");
+    size_t len;
+    const char *s = luaL_optlstring(L, 2, NULL, &len);
+
+    luaL_argcheck(L, xpu->parser != NULL, 1, "parser is closed");
+    if (xpu->pulling != 0 || (xpu->events && pendingevents(xpu)))
+        luaL_error(L, "events of the previous chunk not consumed");
+    lua_settop(L, 2);
+
+    if (xpu->events == NULL) { /* first use? create the queue */
+        xpu->events = lua_newthread(L);
+        lua_getiuservalue(L, 1, 2); /* reused attribute table (or nil) */
+        lua_xmove(L, xpu->events, 1);
+        lua_setiuservalue(L, 1, 3); /* anchor the queue */
+        xpu->head = FIRST_EVENT;
+    }
+
+    XML_SetElementHandler(xpu->parser, ev_StartElement, ev_EndElement);
+    XML_SetCharacterDataHandler(xpu->parser, ev_CharData);
+    xpu->chunk = s;
+    xpu->chunklen = len;
+    xpu->pulling = 1;
+
+    lua_pushcclosure(L, nextevent, 2); /* keep parser and chunk alive */
+    return 1;
+}
+
+
+/* p:skip(): after a "start" event, drop all events up to and
+   including the matching "end" */
+static int lxp_skip (lua_State *L) {
+    lxp_userdata *xpu = (lxp_userdata *)luaL_checkudata(L, 1, "Expat");
+    int depth = 1;
+
+    luaL_argcheck(L, xpu->events != NULL, 1, "not iterating events");
+
+    while (depth > 0 && pendingevents(xpu)) { /* drop queued events */
+        const char *kind = lua_tostring(xpu->events, xpu->head);
+        if (kind[0] == 's')
+            depth++;
+        else if (kind[0] == 'e')
+            depth--;
+        xpu->head += 3;
+    }
+    if (!pendingevents(xpu)) {
+        lua_settop(xpu->events, FIRST_EVENT - 1);
+        xpu->head = FIRST_EVENT;
+    }
+    xpu->skipdepth = depth; /* the rest is dropped by the handlers */
+    return 0;
+}
+
+
 static int lxp_close (lua_State *L) {
     lxp_userdata *xpu =
         (lxp_userdata *)luaL_checkudata(L, 1, "Expat");
@@ -142,6 +679,9 @@ static int lxp_close (lua_State *L) {
     if (xpu->parser)
         XML_ParserFree(xpu->parser);
     xpu->parser = NULL; /* avoids closing it again */
+    free(xpu->text);
+    xpu->text = NULL;
+    freenames(L, xpu);
     return 0;
 }
 
@@ -8,6 +8,15 @@ int luaopen_dir (lua_State *L) {
     lua_pushcfunction(L, dir_gc);
     lua_setfield(L, -2, "__gc");
 
+    luaL_newmetatable(L, WALK_MT);
+    lua_pushcfunction(L, walk_gc);
+    lua_setfield(L, -2, "__gc");
+    luaL_newmetatable(L, WATCH_MT);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, watch_meths, 0);
+    lua_pop(L, 3); /* pop all metatables */
+
     /* create the library */
     luaL_newlib(L, dirlib);
 
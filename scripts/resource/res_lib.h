@@ -4,29 +4,69 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <expat.h>
 #include "lua.h"
 #include "lauxlib.h"
 
 
+typedef struct DirState {
+    DIR *d; /* NULL once closed */
+    int batch; /* entries per call (0: one name per call, no table) */
+    int info; /* 0: names only; 1: also types; 2: types and sizes */
+} DirState;
+
+#define DIR_MAXBATCH 65536
+
 /* forward declaration for the iterator function */
 static int dir_iter (lua_State *L);
 
+/* dir.open(path [, options]): iterate over the entries of 'path'.
+   Option 'type' adds each entry's type, and 'stat' its type and size;
+   with option 'batch' each call returns arrays (of names, types and
+   sizes) of up to that many entries. Types come from the directory
+   entry itself when the system reports them; otherwise, and for sizes,
+   'fstatat' is called relative to the open directory. */
 static int l_dir (lua_State *L) {
     const char *path = luaL_checkstring(L, 1);
+    lua_Integer batch = 0;
+    int info = 0;
+    DirState *ds;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if (lua_getfield(L, 2, "batch") != LUA_TNIL) {
+            batch = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, 0 < batch && batch <= DIR_MAXBATCH, 2,
+                    "invalid batch size");
+        }
+        if (lua_getfield(L, 2, "type") != LUA_TNIL && lua_toboolean(L, -1))
+            info = 1;
+        if (lua_getfield(L, 2, "stat") != LUA_TNIL && lua_toboolean(L, -1))
+            info = 2;
+    }
+
     /* create a userdata to store a DIR address */
-    DIR **d = (DIR **)lua_newuserdata(L, sizeof(DIR *));
+    ds = (DirState *)lua_newuserdata(L, sizeof(DirState));
 
     /* pre-initialize it */
-    *d = NULL;
+    ds->d = NULL;
+    ds->batch = (int)batch;
+    ds->info = info;
     /* set its metatable */
     luaL_getmetatable(L, "LuaBook.dir");
     lua_setmetatable(L, -2);
     /* try to open the given directory */
-    *d = opendir(path);
+    ds->d = opendir(path);
 
-    if (*d == NULL) /* error opening the directory? */
+    if (ds->d == NULL) /* error opening the directory? */
         luaL_error(L, "cannot open %s: %s", path, strerror(errno));
 
     /* creates and returns the iterator function;
@@ -37,27 +77,729 @@ static int l_dir (lua_State *L) {
     return 1;
 }
 
+static const char *modename (mode_t mode) {
+    if (S_ISREG(mode)) return "file";
+    if (S_ISDIR(mode)) return "directory";
+    if (S_ISLNK(mode)) return "link";
+    if (S_ISFIFO(mode)) return "fifo";
+    if (S_ISSOCK(mode)) return "socket";
+    if (S_ISCHR(mode)) return "char";
+    if (S_ISBLK(mode)) return "block";
+    return "unknown";
+}
+
+/* the type of 'entry' in directory 'dfd' and, if 'size' is not NULL,
+   its size (-1 if the entry cannot be 'stat'ed, e.g. it is gone) */
+static const char *entryinfo (int dfd, struct dirent *entry,
+        lua_Integer *size) {
+    struct stat st;
+    const char *type = NULL;
+
+#ifdef DT_UNKNOWN
+    switch (entry->d_type) { /* free when the system fills it in */
+        case DT_REG: type = "file"; break;
+        case DT_DIR: type = "directory"; break;
+        case DT_LNK: type = "link"; break;
+        case DT_FIFO: type = "fifo"; break;
+        case DT_SOCK: type = "socket"; break;
+        case DT_CHR: type = "char"; break;
+        case DT_BLK: type = "block"; break;
+    }
+#endif
+    if (type != NULL && size == NULL)
+        return type;
+
+    if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (size != NULL)
+            *size = -1;
+        return type ? type : "unknown";
+    }
+    if (size != NULL)
+        *size = (lua_Integer)st.st_size;
+    return modename(st.st_mode);
+}
+
+/* push the type of 'entry' and, if 'withsize', its size */
+static void pushinfo (lua_State *L, DIR *d, struct dirent *entry,
+        int withsize) {
+    lua_Integer size;
+
+    lua_pushstring(L, entryinfo(dirfd(d), entry, withsize ? &size : NULL));
+    if (withsize)
+        lua_pushinteger(L, size);
+}
+
+/* close the directory when the iteration is over, instead of
+   waiting for the collector */
+static int dir_done (DirState *ds) {
+    if (ds->d) {
+        closedir(ds->d);
+        ds->d = NULL;
+    }
+    return 0;
+}
+
 static int dir_iter (lua_State *L) {
-    DIR *d = *(DIR **)lua_touserdata(L, lua_upvalueindex(1));
-    struct dirent *entry = readdir(d);
+    DirState *ds = (DirState *)lua_touserdata(L, lua_upvalueindex(1));
+    int ntables = 1 + (ds->info > 0) + (ds->info > 1);
+    struct dirent *entry;
+    int n = 0;
+
+    if (ds->d == NULL) /* already finished? */
+        return 0;
+
+    if (ds->batch == 0) { /* one entry per call */
+        entry = readdir(ds->d);
+        if (entry == NULL)
+            return dir_done(ds); /* no more values to return */
+        lua_pushstring(L, entry->d_name);
+        if (ds->info > 0)
+            pushinfo(L, ds->d, entry, ds->info > 1);
+        return ntables;
+    }
 
-    if (entry != NULL) {
+    /* one array for names, another for types, another for sizes */
+    for (n = 0; n < ntables; n++)
+        lua_createtable(L, ds->batch, 0);
+    n = 0;
+    while (n < ds->batch && (entry = readdir(ds->d)) != NULL) {
+        n++;
         lua_pushstring(L, entry->d_name);
-        return 1;
+        lua_rawseti(L, -1 - ntables, n);
+        if (ds->info > 0) {
+            pushinfo(L, ds->d, entry, ds->info > 1);
+            if (ds->info > 1)
+                lua_rawseti(L, -3, n); /* size */
+            lua_rawseti(L, -1 - ntables + 1, n); /* type */
+        }
     }
-    else return 0; /* no more values to return */
+    if (n == 0)
+        return dir_done(ds);
+    return ntables;
 }
 
 static int dir_gc (lua_State *L) {
-    DIR *d = *(DIR **)lua_touserdata(L, 1);
+    dir_done((DirState *)lua_touserdata(L, 1));
+    return 0;
+}
+
+/*
+** dir.walk: a pool of threads reads the directories of a tree, each
+** one opened with 'openat' relative to its parent, and queues the
+** entries for the iterator. Directories waiting to be read are kept
+** in a bounded list (each holds an open descriptor); when it is full,
+** a thread reads the subdirectory itself. Entries are kept in a
+** bounded ring, so threads wait while Lua is not consuming them.
+*/
+
+#define WALK_MT "LuaBook.walk"
+#define WALK_MAXTHREADS 64
+#define WALK_MAXDIRS 64 /* directories waiting for a thread */
+#define WALK_RING 4096 /* entries waiting for Lua */
+
+typedef struct WalkDir {
+    struct WalkDir *next;
+    int fd;
+    int depth; /* the root is 0 */
+    char path[1]; /* variable part */
+} WalkDir;
+
+typedef struct WalkEntry {
+    char *path;
+    const char *type; /* a static string */
+    lua_Integer size;
+} WalkEntry;
+
+typedef struct Walk {
+    pthread_mutex_t access;
+    pthread_cond_t work; /* a directory was queued, or all is done */
+    pthread_cond_t data; /* an entry was queued, or all is done */
+    pthread_cond_t space; /* an entry was taken */
+    WalkDir *dirs; /* directories waiting for a thread */
+    int ndirs;
+    int active; /* threads reading a directory */
+    WalkEntry ring[WALK_RING];
+    int head, count;
+    atomic_int cancel; /* iterator done or collected: stop soon */
+    int maxdepth; /* -1: no limit */
+    int withsize;
+    int batch; /* 0: one entry per call */
+    char *glob; /* filter for entry names (NULL: all) */
+    int nthreads;
+    pthread_t threads[WALK_MAXTHREADS];
+} Walk;
+
+
+static WalkDir *newwalkdir (const char *path, size_t len, int fd,
+        int depth) {
+    WalkDir *d = (WalkDir *)malloc(sizeof(WalkDir) + len);
+    if (d != NULL) {
+        memcpy(d->path, path, len);
+        d->path[len] = '\0';
+        d->fd = fd;
+        d->depth = depth;
+    }
+    return d;
+}
+
+/* 'dir/name' in a new block (NULL if out of memory) */
+static char *joinpath (const char *dir, const char *name, size_t *len) {
+    size_t ld = strlen(dir), ln = strlen(name);
+    int sep = (ld > 0 && dir[ld - 1] != '/');
+    char *p = (char *)malloc(ld + sep + ln + 1);
+
+    if (p != NULL) {
+        memcpy(p, dir, ld);
+        p[ld] = '/';
+        memcpy(p + ld + sep, name, ln + 1);
+        *len = ld + sep + ln;
+    }
+    return p;
+}
+
+/* queue an entry for Lua, waiting for room; takes 'path' */
+static void walkemit (Walk *w, char *path, const char *type,
+        lua_Integer size) {
+    pthread_mutex_lock(&w->access);
+    while (w->count == WALK_RING && !w->cancel)
+        pthread_cond_wait(&w->space, &w->access);
+    if (w->cancel)
+        free(path);
+    else {
+        WalkEntry *e = &w->ring[(w->head + w->count) % WALK_RING];
+        e->path = path;
+        e->type = type;
+        e->size = size;
+        w->count++;
+        pthread_cond_signal(&w->data);
+    }
+    pthread_mutex_unlock(&w->access);
+}
+
+/* read directory 'd', queuing its entries and subdirectories;
+   frees 'd' and closes its descriptor */
+static void walkdir (Walk *w, WalkDir *d) {
+    DIR *dp = fdopendir(d->fd);
+    struct dirent *entry;
+
+    if (dp == NULL) { /* unreadable directories are skipped */
+        close(d->fd);
+        free(d);
+        return;
+    }
+
+    while (!atomic_load(&w->cancel) && (entry = readdir(dp)) != NULL) {
+        const char *name = entry->d_name;
+        lua_Integer size = -1;
+        const char *type;
+        int descend, report;
+        char *path;
+        size_t len;
+
+        if (name[0] == '.' && (name[1] == '\0' ||
+                    (name[1] == '.' && name[2] == '\0')))
+            continue; /* skip '.' and '..' */
+
+        type = entryinfo(dirfd(dp), entry, w->withsize ? &size : NULL);
+        descend = (strcmp(type, "directory") == 0 &&
+                (w->maxdepth < 0 || d->depth + 1 < w->maxdepth));
+        report = (w->glob == NULL || fnmatch(w->glob, name, 0) == 0);
+        if (!descend && !report)
+            continue; /* no need for its path */
+
+        if ((path = joinpath(d->path, name, &len)) == NULL)
+            continue;
+
+        if (descend) {
+            int fd = openat(dirfd(dp), name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            WalkDir *sub = (fd < 0) ? NULL :
+                newwalkdir(path, len, fd, d->depth + 1);
+            if (sub == NULL) {
+                if (fd >= 0)
+                    close(fd);
+            }
+            else {
+                pthread_mutex_lock(&w->access);
+                if (w->ndirs < WALK_MAXDIRS) { /* let another thread go */
+                    sub->next = w->dirs;
+                    w->dirs = sub;
+                    w->ndirs++;
+                    pthread_cond_signal(&w->work);
+                    sub = NULL;
+                }
+                pthread_mutex_unlock(&w->access);
+                if (sub != NULL) /* list is full: read it here */
+                    walkdir(w, sub);
+            }
+        }
+
+        if (report)
+            walkemit(w, path, type, size);
+        else
+            free(path);
+    }
+
+    closedir(dp); /* also closes 'd->fd' */
+    free(d);
+}
+
+static void *walkthread (void *arg) {
+    Walk *w = (Walk *)arg;
+
+    pthread_mutex_lock(&w->access);
+    for (;;) {
+        WalkDir *d;
+
+        while (!w->cancel && w->dirs == NULL && w->active > 0)
+            pthread_cond_wait(&w->work, &w->access);
+        if (w->cancel || w->dirs == NULL) /* cancelled or finished? */
+            break;
+
+        d = w->dirs;
+        w->dirs = d->next;
+        w->ndirs--;
+        w->active++;
+        pthread_mutex_unlock(&w->access);
+
+        walkdir(w, d);
+
+        pthread_mutex_lock(&w->access);
+        w->active--;
+    }
+    /* wake up the other threads and the iterator, so they see it */
+    pthread_cond_broadcast(&w->work);
+    pthread_cond_broadcast(&w->data);
+    pthread_mutex_unlock(&w->access);
+    return NULL;
+}
+
+/* stop and join all threads (at most once) */
+static void stopwalk (Walk *w) {
+    int i;
+
+    pthread_mutex_lock(&w->access);
+    atomic_store(&w->cancel, 1);
+    pthread_cond_broadcast(&w->work);
+    pthread_cond_broadcast(&w->space);
+    pthread_mutex_unlock(&w->access);
+
+    for (i = 0; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+    w->nthreads = 0;
+}
+
+static int walk_gc (lua_State *L) {
+    Walk *w = (Walk *)luaL_checkudata(L, 1, WALK_MT);
+
+    stopwalk(w);
+    while (w->dirs != NULL) {
+        WalkDir *d = w->dirs;
+        w->dirs = d->next;
+        close(d->fd);
+        free(d);
+    }
+    for (; w->count > 0; w->count--) {
+        free(w->ring[w->head].path);
+        w->head = (w->head + 1) % WALK_RING;
+    }
+    free(w->glob);
+    w->glob = NULL;
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->data);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->access);
+    return 0;
+}
+
+
+/* take the next entry into 'e', waiting for it; 0 at the end */
+static int walknext (Walk *w, WalkEntry *e, int wait) {
+    int found = 0;
+
+    pthread_mutex_lock(&w->access);
+    while (wait && w->count == 0 && (w->dirs != NULL || w->active > 0))
+        pthread_cond_wait(&w->data, &w->access);
+    if (w->count > 0) {
+        *e = w->ring[w->head];
+        w->head = (w->head + 1) % WALK_RING;
+        w->count--;
+        pthread_cond_signal(&w->space);
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->access);
+    return found;
+}
+
+static void pushentry (lua_State *L, WalkEntry *e, int withsize) {
+    lua_pushstring(L, e->path);
+    free(e->path);
+    lua_pushstring(L, e->type);
+    if (withsize)
+        lua_pushinteger(L, e->size);
+}
+
+static int walk_iter (lua_State *L) {
+    Walk *w = (Walk *)lua_touserdata(L, lua_upvalueindex(1));
+    int nres = 2 + w->withsize;
+    WalkEntry e;
+    int n, i;
+
+    if (w->batch == 0) { /* one entry per call */
+        if (!walknext(w, &e, 1)) {
+            stopwalk(w); /* all threads are done: join them */
+            return 0;
+        }
+        pushentry(L, &e, w->withsize);
+        return nres;
+    }
+
+    for (i = 0; i < nres; i++) /* paths, types and sizes */
+        lua_createtable(L, w->batch, 0);
+    for (n = 0; n < w->batch && walknext(w, &e, n == 0); ) {
+        n++;
+        pushentry(L, &e, w->withsize);
+        for (i = nres; i >= 1; i--) /* store in reverse order */
+            lua_rawseti(L, -1 - nres, n);
+    }
+    if (n == 0) {
+        stopwalk(w);
+        return 0;
+    }
+    return nres;
+}
+
+
+/* dir.walk(root [, options]): iterate over all entries below 'root',
+   read by a pool of threads. Each step returns a path and a type, plus
+   a size with option 'stat'; with option 'batch' it returns arrays.
+   Other options: 'threads' (default 4), 'maxdepth' (1: only the
+   entries of 'root') and 'glob' (a pattern for 'fnmatch' that entry
+   names must match to be returned; all directories are still
+   walked). Symbolic links are not followed, and unreadable
+   directories are skipped. */
+static int l_walk (lua_State *L) {
+    const char *root = luaL_checkstring(L, 1);
+    lua_Integer nthreads = 4, maxdepth = -1, batch = 0;
+    const char *glob = NULL;
+    int withsize = 0;
+    WalkDir *d;
+    Walk *w;
+    int fd, i;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if (lua_getfield(L, 2, "threads") != LUA_TNIL) {
+            nthreads = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, 0 < nthreads && nthreads <= WALK_MAXTHREADS,
+                    2, "invalid number of threads");
+        }
+        if (lua_getfield(L, 2, "maxdepth") != LUA_TNIL) {
+            maxdepth = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, maxdepth > 0, 2, "invalid depth");
+        }
+        if (lua_getfield(L, 2, "batch") != LUA_TNIL) {
+            batch = luaL_checkinteger(L, -1);
+            luaL_argcheck(L, 0 < batch && batch <= DIR_MAXBATCH, 2,
+                    "invalid batch size");
+        }
+        if (lua_getfield(L, 2, "glob") != LUA_TNIL)
+            glob = luaL_checkstring(L, -1);
+        withsize = lua_getfield(L, 2, "stat") != LUA_TNIL &&
+            lua_toboolean(L, -1);
+    }
+
+    /* create the walk in a state that 'walk_gc' can clean up */
+    w = (Walk *)lua_newuserdatauv(L, sizeof(Walk), 0);
+    pthread_mutex_init(&w->access, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->data, NULL);
+    pthread_cond_init(&w->space, NULL);
+    w->dirs = NULL;
+    w->ndirs = 0;
+    w->active = 0;
+    w->head = w->count = 0;
+    atomic_init(&w->cancel, 0);
+    w->maxdepth = (int)maxdepth;
+    w->withsize = withsize;
+    w->batch = (int)batch;
+    w->glob = NULL;
+    w->nthreads = 0;
+    luaL_setmetatable(L, WALK_MT);
+
+    if (glob != NULL && (w->glob = strdup(glob)) == NULL)
+        luaL_error(L, "not enough memory");
+    fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        luaL_error(L, "cannot open %s: %s", root, strerror(errno));
+    if ((d = newwalkdir(root, strlen(root), fd, 0)) == NULL) {
+        close(fd);
+        luaL_error(L, "not enough memory");
+    }
+    d->next = NULL;
+    w->dirs = d;
+    w->ndirs = 1;
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&w->threads[w->nthreads], NULL, walkthread, w)
+                == 0)
+            w->nthreads++;
+    }
+    if (w->nthreads == 0)
+        luaL_error(L, "unable to create threads");
+
+    lua_pushcclosure(L, walk_iter, 1);
+    return 1;
+}
 
-    if (d) closedir(d);
+/*
+** dir.watch (Linux only): changes in a directory, from inotify. Each
+** refill reads everything that is pending (and, with a 'delay', what
+** arrives during it) and merges the events for the same name: a file
+** created and then modified is only "create", one created and then
+** deleted is dropped, one deleted and created again is "modify".
+*/
 
+#define WATCH_MT "LuaBook.watch"
+
+enum { W_NONE, W_CREATE, W_MODIFY, W_DELETE, W_OVERFLOW };
+
+static const char *const watchevents[] = {
+    NULL, "create", "modify", "delete", "overflow"
+};
+
+typedef struct Watch {
+    int fd; /* inotify descriptor; -1 when closed */
+    int delay; /* milliseconds to wait for more events in a burst */
+    lua_Integer head, count; /* pending events are head..count */
+} Watch;
+
+#define checkwatch(L) ((Watch *)luaL_checkudata(L, 1, WATCH_MT))
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | \
+        IN_DELETE | IN_MOVED_FROM)
+
+static int mergeevent (int old, int ev) {
+    switch (old) {
+        case W_NONE: return ev;
+        case W_CREATE: return (ev == W_DELETE) ? W_NONE : W_CREATE;
+        case W_DELETE: return (ev == W_DELETE) ? W_DELETE : W_MODIFY;
+        default: return (ev == W_DELETE) ? W_DELETE : old;
+    }
+}
+
+/* merge one event into the tables names (-3), events (-2) and
+   index (-1), which maps names to their positions */
+static void addevent (lua_State *L, Watch *w, const char *name,
+        size_t len, int ev) {
+    lua_Integer i;
+
+    lua_pushlstring(L, name, len);
+    if (lua_rawget(L, -2) == LUA_TNUMBER) { /* seen in this burst? */
+        i = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        lua_rawgeti(L, -2, i);
+        ev = mergeevent((int)lua_tointeger(L, -1), ev);
+        lua_pop(L, 1);
+    }
+    else {
+        lua_pop(L, 1);
+        i = ++w->count;
+        lua_pushlstring(L, name, len);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -5, i); /* names[i] = name */
+        lua_pushinteger(L, i);
+        lua_rawset(L, -3); /* index[name] = i */
+    }
+    lua_pushinteger(L, ev);
+    lua_rawseti(L, -3, i); /* events[i] = ev */
+}
+
+/* read and merge all events that are ready */
+static void readevents (lua_State *L, Watch *w) {
+    char buff[16 * 1024]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(w->fd, buff, sizeof(buff))) > 0) {
+        char *p;
+        for (p = buff; p < buff + n;
+                p += sizeof(struct inotify_event) +
+                     ((struct inotify_event *)p)->len) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            int ev;
+            if (e->mask & IN_Q_OVERFLOW)
+                ev = W_OVERFLOW; /* some events were lost: rescan */
+            else if (e->mask & (IN_CREATE | IN_MOVED_TO))
+                ev = W_CREATE;
+            else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+                ev = W_DELETE;
+            else if (e->mask & (IN_MODIFY | IN_CLOSE_WRITE))
+                ev = W_MODIFY;
+            else
+                continue;
+            if (e->len > 0)
+                addevent(L, w, e->name, strlen(e->name), ev);
+            else if (ev == W_OVERFLOW)
+                addevent(L, w, "", 0, ev);
+            /* else an event on the directory itself */
+        }
+    }
+}
+
+static long long nowms (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wait up to 'timeout' milliseconds (-1: forever) for events and
+   collect a burst of them into new pending tables; the burst ends
+   'w->delay' milliseconds after its first event, however busy the
+   directory stays */
+static int refill (lua_State *L, Watch *w, int timeout) {
+    struct pollfd pfd;
+    long long until;
+    int left;
+
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) <= 0)
+        return 0;
+
+    w->head = 1;
+    w->count = 0;
+    lua_newtable(L); /* names */
+    lua_newtable(L); /* events */
+    lua_newtable(L); /* index */
+    until = nowms() + w->delay;
+    do {
+        readevents(L, w);
+        left = (int)(until - nowms());
+    } while (left > 0 && poll(&pfd, 1, left) > 0);
+    lua_pop(L, 1); /* index is not needed anymore */
+    lua_setiuservalue(L, lua_upvalueindex(1), 2);
+    lua_setiuservalue(L, lua_upvalueindex(1), 1);
+    return w->count > 0;
+}
+
+static int watch_iter (lua_State *L) {
+    Watch *w = (Watch *)lua_touserdata(L, lua_upvalueindex(1));
+
+    if (w->fd < 0)
+        luaL_error(L, "watch is closed");
+
+    for (;;) {
+        int ev;
+
+        if (w->head > w->count) { /* nothing pending? */
+            int timeout = (int)lua_tointeger(L, lua_upvalueindex(2));
+            lua_pushinteger(L, 0); /* later steps do not wait */
+            lua_replace(L, lua_upvalueindex(2));
+            if (!refill(L, w, timeout))
+                return 0;
+        }
+
+        lua_getiuservalue(L, lua_upvalueindex(1), 2);
+        lua_rawgeti(L, -1, w->head);
+        ev = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        if (ev != W_NONE) { /* not cancelled out? */
+            lua_getiuservalue(L, lua_upvalueindex(1), 1);
+            lua_rawgeti(L, -1, w->head++);
+            lua_pushstring(L, watchevents[ev]);
+            return 2;
+        }
+        w->head++;
+    }
+}
+
+/* dir.watch(path [, options]): a watch over the entries of 'path'.
+   Option 'delay' (in seconds) keeps collecting events for that long
+   after the first one of a burst, so that more of them are merged */
+static int l_watch (lua_State *L) {
+    const char *path = luaL_checkstring(L, 1);
+    lua_Number delay = 0;
+    Watch *w;
+
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        if (lua_getfield(L, 2, "delay") != LUA_TNIL) {
+            delay = luaL_checknumber(L, -1);
+            luaL_argcheck(L, delay >= 0, 2, "negative delay");
+        }
+    }
+
+    /* user values: names and events of the pending burst */
+    w = (Watch *)lua_newuserdatauv(L, sizeof(Watch), 2);
+    w->fd = -1;
+    w->delay = (int)(delay * 1000);
+    w->head = 1;
+    w->count = 0;
+    luaL_setmetatable(L, WATCH_MT);
+
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0)
+        luaL_error(L, "cannot create watch: %s", strerror(errno));
+    if (inotify_add_watch(w->fd, path, WATCH_MASK | IN_ONLYDIR) < 0)
+        luaL_error(L, "cannot watch %s: %s", path, strerror(errno));
+
+    return 1;
+}
+
+#else
+
+static int watch_iter (lua_State *L) {
+    return luaL_error(L, "watch is closed");
+}
+
+static int l_watch (lua_State *L) {
+    return luaL_error(L, "dir.watch needs inotify (Linux)");
+}
+
+#endif
+
+/* watch:events([timeout]): iterate over the changes, waiting up to
+   'timeout' seconds (default: forever) for the first one; the loop
+   ends once no more changes are pending */
+static int watch_events (lua_State *L) {
+    Watch *w = checkwatch(L);
+    lua_Number timeout = luaL_optnumber(L, 2, -1);
+
+    luaL_argcheck(L, w->fd >= 0, 1, "watch is closed");
+    lua_settop(L, 1);
+    lua_pushinteger(L, (timeout < 0) ? -1 : (lua_Integer)(timeout * 1000));
+    lua_pushcclosure(L, watch_iter, 2);
+    return 1;
+}
+
+static int watch_close (lua_State *L) {
+    Watch *w = checkwatch(L);
+
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
     return 0;
 }
 
+static const struct luaL_Reg watch_meths [] = {
+    {"events", watch_events},
+    {"close", watch_close},
+    {"__gc", watch_close},
+    {NULL, NULL}
+};
+
 static const struct luaL_Reg dirlib [] = {
     {"open", l_dir},
+    {"walk", l_walk},
+    {"watch", l_watch},
     {NULL, NULL}
 };
 
@@ -0,0 +1,59 @@
+-- checks for 'xmlsplit':
+--     lua test_xmlsplit.lua
+local lproc = require "lproc"
+local xmlsplit = require "xmlsplit"
+
+-- names of all the elements reported, and all non-blank text
+local function setup ()
+    local seen = {}
+    local cb = {
+        StartElement = function (p, name) seen[#seen + 1] = name end,
+        CharacterData = function (p, s)
+            if s:find("%S") then seen[#seen + 1] = "#" .. s end
+        end,
+    }
+    return cb, function () return seen end
+end
+
+-- records interleaved with other elements and text, an empty record
+-- and '>' and "/>" inside attribute values
+local doc = [[
+<?xml version="1.0"?>
+<feed>
+  <header>before</header>
+  <item id="1"><title>one</title></item>
+  loose text
+  <other><title>not a record</title></other>
+  <item id="2" note="a > b"/>
+  <!-- a comment -->
+  <item id="3" note='x/>'><title>three</title></item>
+  <trailer>after</trailer>
+</feed>
+]]
+
+local expected = "item title #one item item title #three"
+for _, batch in ipairs{1, 40, 1 << 20} do -- one record per batch or all
+    local seen = xmlsplit.parse(doc, "item", setup,
+            {workers = 2, batch = batch})
+    assert(table.concat(seen, " ") == expected, table.concat(seen, " "))
+end
+
+-- a record without an end tag is an error
+local ok, err = pcall(xmlsplit.parse, "<feed><item><a/></feed>", "item",
+        setup)
+assert(not ok and err:find("invalid XML"), err)
+
+-- so is a malformed record; the pools 'parse' creates are closed
+-- anyway, and one given by the caller is left open
+local bad = "<feed><item><title>x</item><item/></feed>"
+for _ = 1, 20 do
+    ok, err = pcall(xmlsplit.parse, bad, "item", setup, {workers = 2})
+    assert(not ok and err:find("invalid XML"), err)
+end
+local pool = lproc.pool(2)
+ok, err = pcall(xmlsplit.parse, bad, "item", setup, {pool = pool})
+assert(not ok and err:find("invalid XML"), err)
+assert(pool:submit("return 1"):get() == 1) -- still usable
+pool:close()
+
+print("ok")
@@ -0,0 +1,154 @@
+-- parse a document made of many independent records on several
+-- lproc workers, each with its own lxp parser:
+--
+--     local xmlsplit = require "xmlsplit"
+--     local prices = xmlsplit.parse(doc, "item", function ()
+--         local out = {}
+--         local cb = {StartElement = function (p, name, attrs)
+--             if name == "price" then out[#out + 1] = attrs.value end
+--         end}
+--         return cb, function () return out end
+--     end, {workers = 4})
+--
+-- 'doc' is a string or an lproc buffer; "item" is the name of the
+-- records, which must be children of the root element. The setup
+-- function runs in the workers, so it cannot use upvalues and must
+-- 'require' the libraries it uses; it runs once per batch and returns
+-- a callback table and a function that gives the batch's results as
+-- an array. 'parse' returns all these arrays joined in document order.
+--
+-- Record boundaries are found by looking for "<item" followed by a
+-- space, '/' or '>' and for the matching "</item>", so records cannot
+-- nest, and that text cannot appear inside comments or CDATA sections.
+-- Each batch is parsed after the document's own prologue and root
+-- start tag (so namespace declarations and internal entities still
+-- work); content outside the records is not reported.
+local lproc = require "lproc"
+
+local xmlsplit = {}
+
+local BATCH = 1024 * 1024 -- default bytes per batch
+
+-- runs in a worker: parse the records in bytes i..j of 'buf' as the
+-- content of the root element, leaving out whatever lies between them.
+-- (It is shipped to the workers as bytecode, so it cannot have upvalues)
+local function runbatch (setup, buf, i, j, head, tail, pattern, endtag,
+        options)
+    local lxp = require "lxp"
+    local string = require "string"
+    local table = require "table"
+    local s = buf:sub(i, j)
+
+    -- end of the tag starting at 'k' (skipping quoted attribute values)
+    local function tagend (k)
+        repeat
+            k = string.find(s, "[>\"']", k + 1)
+            local c = k and string.sub(s, k, k)
+            if c == '"' or c == "'" then
+                k = string.find(s, c, k + 1, true)
+            end
+        until k == nil or c == ">"
+        return k
+    end
+
+    local records = {}
+    local k = string.find(s, pattern)
+    local _, close = string.find(s, endtag) -- next end tag (nil if none)
+    while k do
+        local n = string.find(s, pattern, k + 1) -- next record
+        local e
+        if close and close < k then
+            _, close = string.find(s, endtag, k + 1)
+        end
+        if close and (n == nil or close < n) then
+            e = close
+        else -- no end tag before the next record: must be an empty one
+            e = tagend(k)
+            if e and string.sub(s, e - 1, e - 1) ~= "/" then e = nil end
+        end
+        if not e then
+            error(string.format("invalid XML in bytes %d-%d", i, j))
+        end
+        records[#records + 1] = string.sub(s, k, e)
+        k = n
+    end
+
+    local callbacks, collect = load(setup, "=setup", "b")()
+    local handlers = {}
+    local p = lxp.new(handlers, options)
+
+    -- handlers are looked up on each 'parse', so the prologue and the
+    -- end of the root element are parsed without them
+    assert(p:parse(head))
+    for name, f in pairs(callbacks) do handlers[name] = f end
+    local ok = p:parse(table.concat(records))
+    for name in pairs(callbacks) do handlers[name] = nil end
+    ok = ok and p:parse(tail) and p:parse()
+    p:close()
+    if not ok then
+        error(string.format("invalid XML in bytes %d-%d", i, j))
+    end
+    return collect()
+end
+
+local function escape (s)
+    return (string.gsub(s, "%p", "%%%0"))
+end
+
+-- start of the first record at or after 'init' (nil if none)
+local function findrecord (s, pattern, init, limit)
+    local i = string.find(s, pattern, init)
+    if i and i <= limit then return i end
+end
+
+-- xmlsplit.parse(doc, record, setup [, options]); options: 'workers'
+-- (default 4), 'batch' (bytes per batch, default 1 MB), 'pool' (an
+-- existing lproc pool) and 'parser' (options for lxp.new)
+function xmlsplit.parse (doc, record, setup, options)
+    options = options or {}
+    local buf = doc
+    if type(doc) == "string" then
+        buf = lproc.buffer(doc) -- shared with the workers, not copied
+    else
+        doc = buf:sub() -- the scan below needs a string
+    end
+    local batch = options.batch or BATCH
+    local code = string.dump(setup)
+
+    local pattern = "<" .. escape(record) .. "[%s/>]"
+    local endtag = "</" .. escape(record) .. "%s*>"
+    local first = string.find(doc, pattern)
+    if not first then return {} end
+
+    -- the root element: its name and everything up to its start tag
+    local roottag = assert(string.find(doc, "<[^?!]"), "no root element")
+    local rootname = string.match(doc, "^<([^%s/>]+)", roottag)
+    local last = string.find(doc, "</" .. escape(rootname) .. "%s*>%s*$",
+            math.max(1, #doc - 4096))
+            or string.find(doc, "</" .. escape(rootname) .. "%s*>%s*$")
+    assert(last, "no end tag for the root element")
+    local head = string.sub(doc, 1, first - 1)
+    local tail = "</" .. rootname .. ">"
+
+    local pool = options.pool or lproc.pool(options.workers or 4)
+    local results = {}
+    local ok, err = pcall(function ()
+        local futures = {}
+        local i = first
+        while i < last do
+            local j = findrecord(doc, pattern, i + batch, last) or last
+            futures[#futures + 1] = pool:submit(runbatch, code, buf, i,
+                    j - 1, head, tail, pattern, endtag, options.parser)
+            i = j
+        end
+        for _, f in ipairs(futures) do -- merge in document order
+            local r = f:get()
+            table.move(r, 1, #r, #results + 1, results)
+        end
+    end)
+    if not options.pool then pool:close() end -- even after an error
+    if not ok then error(err, 0) end
+    return results
+end
+
+return xmlsplit
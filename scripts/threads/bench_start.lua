@@ -0,0 +1,32 @@
+-- measure how fast lproc starts processes; run it under 'time':
+--     time lua bench_start.lua 4000
+-- the first start compiles the chunk, the others reuse its bytecode
+local lproc = require "lproc"
+
+-- a chunk of realistic size: some helper functions and a tiny body
+local parts = {}
+for i = 1, 60 do
+    parts[#parts + 1] = string.format([[
+local function helper%d (t, x)
+    local s = 0
+    for i = 1, #t do s = s + t[i] * x + %d end
+    if s > 1e9 then return nil, "overflow" end
+    return s, {n = #t, x = x, tag = "helper%d"}
+end
+]], i, i, i)
+end
+parts[#parts + 1] = "return helper1({1, 2, 3}, 2)"
+local chunk = table.concat(parts)
+
+local N = tonumber(arg and arg[1]) or 2000
+local W = 8 -- processes running at the same time
+
+local i = 0
+while i < N do
+    local procs = {}
+    for j = 1, W do procs[j] = lproc.start(chunk) end
+    for j = 1, W do assert(procs[j]:join()) end
+    i = i + W
+end
+
+print(string.format("%d starts of a %d-byte chunk", i, #chunk))
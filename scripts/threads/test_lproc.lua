@@ -0,0 +1,33 @@
+-- checks for 'lproc':
+--     lua test_lproc.lua
+local lproc = require "lproc"
+
+-- functions are shipped as bytecode, which cannot carry upvalues;
+-- those with any upvalue other than _ENV are rejected
+local n = 10
+local function closure () return n end
+local function global () return require("math").pi end
+
+local pool = lproc.pool(2)
+local ok, err = pcall(pool.submit, pool, closure)
+assert(not ok and err:find("without upvalues"), err)
+assert(pool:submit(global):get() == math.pi)
+assert(pool:submit(function (x) return x + 1 end, 1):get() == 2)
+pool:close()
+
+ok, err = pcall(lproc.start, closure)
+assert(not ok and err:find("without upvalues"), err)
+assert(select(2, lproc.start(global):join()) == require("math").pi)
+
+ok, err = pcall(lproc.preload, "closure", closure)
+assert(not ok and err:find("without upvalues"), err)
+
+-- a function started as a process keeps its own source name, and
+-- broken bytecode is reported under a readable one
+local _, msg = lproc.start(function () error("oops") end):join()
+assert(msg:find("test_lproc%.lua:%d+: oops"), msg)
+local code = string.dump(function () return 1 end)
+ok, msg = pcall(lproc.start, code:sub(1, #code // 2))
+assert(not ok and msg:find("^error in thread body: %(lproc%.start%)"), msg)
+
+print("ok")
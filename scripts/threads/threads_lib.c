@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* for dladdr and RTLD_NODELETE */
 #include "lua.h"
 #include "threads_lib.h"
 
@@ -5,11 +6,80 @@ static const struct luaL_Reg ll_funcs[] = {
     {"start", ll_start},
     {"send", ll_send},
     {"receive", ll_receive},
+    {"trysend", ll_trysend},
+    {"tryreceive", ll_tryreceive},
+    {"select", ll_select},
     {"exit", ll_exit},
+    {"channel", ll_channel},
+    {"buffer", ll_buffer},
+    {"pool", ll_pool},
+    {"preload", ll_preload},
+    {"stats", ll_stats},
+    {"dumpstats", ll_dumpstats},
     {NULL, NULL}
 };
 
+static const struct luaL_Reg channel_meths[] = {
+    {"__tostring", channel_tostring},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg buffer_meths[] = {
+    {"sub", buffer_sub},
+    {"__len", buffer_len},
+    {"__tostring", buffer_tostring},
+    {"__gc", buffer_gc},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg pool_meths[] = {
+    {"submit", pool_submit},
+    {"close", pool_close},
+    {"__gc", pool_close},
+    {"__tostring", pool_tostring},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg future_meths[] = {
+    {"get", future_get},
+    {"ready", future_ready},
+    {"elapsed", future_elapsed},
+    {"__gc", future_gc},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg proc_meths[] = {
+    {"join", proc_join},
+    {"result", proc_result},
+    {"status", proc_status},
+    {"elapsed", proc_elapsed},
+    {"__gc", proc_gc},
+    {NULL, NULL}
+};
+
+/* create a metatable whose __index is itself */
+static void newclass (lua_State *L, const char *tname,
+        const luaL_Reg *meths) {
+    luaL_newmetatable(L, tname);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, meths, 0);
+    lua_pop(L, 1);
+}
+
 int luaopen_lproc (lua_State *L) {
+    pinlibrary();
+
+    /* metatable for channel handles */
+    luaL_newmetatable(L, CHANNEL_MT);
+    luaL_setfuncs(L, channel_meths, 0);
+    lua_pop(L, 1);
+
+    newclass(L, BUFFER_MT, buffer_meths);
+    newclass(L, POOL_MT, pool_meths);
+    newclass(L, FUTURE_MT, future_meths);
+    newclass(L, PROCESS_MT, proc_meths);
+
     luaL_newlib(L, ll_funcs); /* open library */
     return 1;
 }
@@ -1,8 +1,15 @@
 #ifndef THREADS_LIB_H
 #define THREADS_LIB_H
 
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -11,20 +18,316 @@ static int ll_start (lua_State *L);
 static int ll_send (lua_State *L);
 static int ll_receive (lua_State *L);
 static int ll_exit (lua_State *L);
+static int ll_channel (lua_State *L);
+static int ll_buffer (lua_State *L);
+static int ll_trysend (lua_State *L);
+static int ll_tryreceive (lua_State *L);
+static int ll_pool (lua_State *L);
+static int ll_preload (lua_State *L);
+static int ll_select (lua_State *L);
+static int ll_stats (lua_State *L);
+static int ll_dumpstats (lua_State *L);
 int luaopen_lproc (lua_State *L);
 
+typedef struct Channel Channel;
+
 typedef struct Proc {
     lua_State *L;
     pthread_t thread;
     pthread_cond_t cond;
-    const char *channel;
+    Channel *channel; /* channel it is waiting on (NULL if none) */
     struct Proc *previous, *next;
+    unsigned int nextselect; /* where its next 'select' starts looking */
 } Proc;
 
-static Proc *waitsend = NULL;
-static Proc *waitreceive = NULL;
+/* per-channel counters (see 'lproc.stats') */
+#define WAIT_BUCKETS 40 /* bucket i counts waits in [2^i, 2^(i+1)) ns */
+
+typedef struct ChannelStats {
+    unsigned long long sent, received;
+    unsigned long long bytes; /* bytes copied in messages */
+    unsigned long long contended; /* lock acquisitions that waited */
+    double lockwait; /* seconds spent waiting for the lock */
+    unsigned long long waits[WAIT_BUCKETS]; /* time blocked in lists */
+} ChannelStats;
+
+/* channels are interned: there is exactly one 'Channel' for each
+   name, and it lives until the program ends */
+struct Channel {
+    pthread_mutex_t access; /* protects the lists and the queue */
+    Proc *waitsend; /* processes waiting to send on this channel */
+    Proc *waitreceive; /* processes waiting to receive from it */
+    lua_Integer capacity; /* max. buffered messages (0: rendezvous) */
+    struct Message *first, *last; /* buffered messages, oldest first */
+    lua_Integer head, tail; /* tail - head messages are buffered */
+    struct SelectNode *selectors; /* 'lproc.select' calls waiting on it */
+    ChannelStats stats; /* updated holding 'access' */
+    unsigned int hash;
+    size_t len;
+    Channel *next; /* next channel in the same bucket */
+    char name[1]; /* variable part */
+};
+
+#define CHANNEL_MT "lproc.Channel"
+#define MIN_CHANNEL_BUCKETS 64 /* must be a power of 2 */
+
+/* the channel table; the lock is only held for writing when
+   a new name is interned, so lookups proceed in parallel */
+static Channel **channels = NULL;
+static size_t nbuckets = 0;
+static size_t nchannels = 0;
+static pthread_rwlock_t channels_access = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/*
+** Statistics. Channel counters are only touched while holding the
+** channel's lock, so they cost a few plain increments. Counters for
+** the channel table lock are kept per thread and added up on read.
+*/
+
+typedef struct LockStats {
+    atomic_ullong acquisitions, contended;
+    atomic_ullong waitns, holdns; /* hold time only for writers */
+    int inuse; /* owned by a running thread? */
+    struct LockStats *next;
+} LockStats;
+
+static LockStats *lockstats = NULL; /* one block per thread */
+static pthread_mutex_t lockstats_access = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t lockstats_key;
+static pthread_once_t lockstats_once = PTHREAD_ONCE_INIT;
+
+/* add to a counter written only by its own thread */
+#define bump(c, v) \
+    atomic_store_explicit(&(c), atomic_load_explicit(&(c), \
+                memory_order_relaxed) + (v), memory_order_relaxed)
+
+
+static unsigned long long nowns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull +
+        (unsigned long long)ts.tv_nsec;
+}
+
+
+/* a thread ended: its block can be reused (counts are kept) */
+static void releaselockstats (void *p) {
+    pthread_mutex_lock(&lockstats_access);
+    ((LockStats *)p)->inuse = 0;
+    pthread_mutex_unlock(&lockstats_access);
+}
+
+static void makelockstatskey (void) {
+    pthread_key_create(&lockstats_key, releaselockstats);
+}
+
+
+/* the counters of the calling thread (NULL if out of memory) */
+static LockStats *mylockstats (void) {
+    LockStats *s;
+
+    pthread_once(&lockstats_once, makelockstatskey);
+    s = (LockStats *)pthread_getspecific(lockstats_key);
+    if (s != NULL)
+        return s;
+
+    pthread_mutex_lock(&lockstats_access);
+    for (s = lockstats; s != NULL && s->inuse; s = s->next)
+        ;
+    if (s == NULL && (s = (LockStats *)calloc(1, sizeof(LockStats)))
+            != NULL) {
+        s->next = lockstats;
+        lockstats = s;
+    }
+    if (s != NULL)
+        s->inuse = 1;
+    pthread_mutex_unlock(&lockstats_access);
+
+    if (s != NULL)
+        pthread_setspecific(lockstats_key, s);
+    return s;
+}
+
+
+/* lock the channel table for reading or writing, counting waits */
+static void locktable (int write) {
+    LockStats *s = mylockstats();
+    int busy = write ? pthread_rwlock_trywrlock(&channels_access)
+                     : pthread_rwlock_tryrdlock(&channels_access);
+
+    if (busy) {
+        unsigned long long t0 = nowns();
+        if (write)
+            pthread_rwlock_wrlock(&channels_access);
+        else
+            pthread_rwlock_rdlock(&channels_access);
+        if (s != NULL) {
+            bump(s->contended, 1);
+            bump(s->waitns, nowns() - t0);
+        }
+    }
+    if (s != NULL)
+        bump(s->acquisitions, 1);
+}
+
+
+static void lockchannel (Channel *c) {
+    if (pthread_mutex_trylock(&c->access) != 0) { /* contended? */
+        unsigned long long t0 = nowns();
+        pthread_mutex_lock(&c->access);
+        c->stats.contended++;
+        c->stats.lockwait += (nowns() - t0) * 1e-9;
+    }
+}
+
+
+/* count a wait of 'ns' nanoseconds; must hold 'c->access' */
+static void recordwait (Channel *c, unsigned long long ns) {
+    int i = 0;
+
+    while (ns > 1 && i < WAIT_BUCKETS - 1) {
+        ns >>= 1;
+        i++;
+    }
+    c->stats.waits[i]++;
+}
+
+
+/* wait time (in seconds) below which a fraction 'q' of the waits
+   fall, rounded up to the end of its power-of-two bucket */
+static double waitquantile (const ChannelStats *s, double q) {
+    unsigned long long total = 0, acc = 0;
+    int i;
+
+    for (i = 0; i < WAIT_BUCKETS; i++)
+        total += s->waits[i];
+    if (total == 0)
+        return 0;
+
+    for (i = 0; i < WAIT_BUCKETS - 1; i++) {
+        acc += s->waits[i];
+        if ((double)acc >= q * (double)total)
+            break;
+    }
+    return (double)(1ull << (i + 1)) * 1e-9;
+}
+
+
+static unsigned int hashname (const char *name, size_t len) {
+    unsigned int h = 2166136261u; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+static Channel *findchannel (const char *name, size_t len,
+        unsigned int h) {
+    Channel *c;
+
+    if (channels == NULL)
+        return NULL;
+
+    for (c = channels[h & (nbuckets - 1)]; c != NULL; c = c->next) {
+        if (c->hash == h && c->len == len &&
+                memcmp(c->name, name, len) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+
+/* double the bucket array; must hold 'channels_access' for writing */
+static int growchannels (void) {
+    size_t newsize = (nbuckets == 0) ? MIN_CHANNEL_BUCKETS : 2 * nbuckets;
+    Channel **newchannels = (Channel **)calloc(newsize, sizeof(Channel *));
+    size_t i;
+
+    if (newchannels == NULL)
+        return 0;
+
+    for (i = 0; i < nbuckets; i++) { /* rehash all channels */
+        Channel *c = channels[i];
+        while (c != NULL) {
+            Channel *next = c->next;
+            Channel **bucket = &newchannels[c->hash & (newsize - 1)];
+            c->next = *bucket;
+            *bucket = c;
+            c = next;
+        }
+    }
+
+    free(channels);
+    channels = newchannels;
+    nbuckets = newsize;
+    return 1;
+}
+
+
+/* return the channel with the given name, creating it if needed */
+static Channel *internchannel (lua_State *L, const char *name,
+        size_t len) {
+    unsigned int h = hashname(name, len);
+    unsigned long long t0;
+    LockStats *ls;
+    Channel *c;
+
+    locktable(0);
+    c = findchannel(name, len, h);
+    pthread_rwlock_unlock(&channels_access);
+    if (c != NULL)
+        return c;
+
+    locktable(1);
+    t0 = nowns();
+    c = findchannel(name, len, h); /* someone may have created it */
+    if (c == NULL && (nchannels < nbuckets || growchannels())) {
+        c = (Channel *)malloc(sizeof(Channel) + len);
+        if (c != NULL) {
+            Channel **bucket = &channels[h & (nbuckets - 1)];
+            pthread_mutex_init(&c->access, NULL);
+            c->waitsend = c->waitreceive = NULL;
+            c->capacity = 0;
+            c->first = c->last = NULL;
+            c->head = c->tail = 1;
+            c->selectors = NULL;
+            memset(&c->stats, 0, sizeof(c->stats));
+            c->hash = h;
+            c->len = len;
+            memcpy(c->name, name, len);
+            c->name[len] = '\0';
+            c->next = *bucket;
+            *bucket = c;
+            nchannels++;
+        }
+    }
+    if ((ls = mylockstats()) != NULL)
+        bump(ls->holdns, nowns() - t0);
+    pthread_rwlock_unlock(&channels_access);
+
+    if (c == NULL)
+        luaL_error(L, "unable to create channel '%s'", name);
+    return c;
+}
+
 
-static pthread_mutex_t kernel_access = PTHREAD_MUTEX_INITIALIZER;
+/* accept either a channel name or a channel object */
+static Channel *checkchannel (lua_State *L, int arg) {
+    Channel **pc = (Channel **)luaL_testudata(L, arg, CHANNEL_MT);
+    size_t len;
+    const char *name;
+
+    if (pc != NULL)
+        return *pc;
+
+    name = luaL_checklstring(L, arg, &len);
+    return internchannel(L, name, len);
+}
 
 
 static Proc *getself (lua_State *L) {
@@ -33,44 +336,521 @@ static Proc *getself (lua_State *L) {
     lua_getfield(L, LUA_REGISTRYINDEX, "_SELF");
     p = (Proc *)lua_touserdata(L, -1);
     lua_pop(L, 1);
+
+    if (p == NULL) { /* state not created by lproc (e.g., the main one)? */
+        p = (Proc *)lua_newuserdata(L, sizeof(Proc));
+        lua_setfield(L, LUA_REGISTRYINDEX, "_SELF");
+        p->L = L;
+        p->thread = pthread_self();
+        p->channel = NULL;
+        p->nextselect = 0;
+        pthread_cond_init(&p->cond, NULL);
+    }
     return p;
 }
 
 
+/* immutable byte buffer shared (not copied) between states */
+typedef struct SharedBuffer {
+    atomic_size_t refs; /* number of userdata pointing to it */
+    size_t len;
+    char data[1]; /* variable part */
+} SharedBuffer;
+
+#define BUFFER_MT "lproc.Buffer"
+#define checkbuffer(L, i) \
+    (*(SharedBuffer **)luaL_checkudata(L, i, BUFFER_MT))
+
+
+/* push a new userdata referring to an existing shared buffer */
+static void pushbuffer (lua_State *L, SharedBuffer *b) {
+    SharedBuffer **pb = (SharedBuffer **)lua_newuserdatauv(L,
+            sizeof(SharedBuffer *), 0);
+    *pb = b;
+    atomic_fetch_add(&b->refs, 1);
+    luaL_setmetatable(L, BUFFER_MT);
+}
+
+
+/* check that the value at 'idx' can be sent to another state;
+   'seen' is the stack index of a set of visited tables (or 0) */
+static void checkvalue (lua_State *L, int idx, int *seen,
+        size_t *bytes) {
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TNUMBER:
+            *bytes += sizeof(lua_Integer);
+            return;
+        case LUA_TSTRING:
+            *bytes += lua_rawlen(L, idx);
+            return;
+        case LUA_TUSERDATA:
+            if (luaL_testudata(L, idx, BUFFER_MT) != NULL) {
+                *bytes += sizeof(SharedBuffer *); /* not copied */
+                return;
+            }
+            break;
+        case LUA_TTABLE: {
+            idx = lua_absindex(L, idx);
+            luaL_checkstack(L, 4, "table too deep");
+            if (*seen == 0) { /* first table? create the visited set */
+                lua_newtable(L);
+                *seen = lua_gettop(L);
+            }
+            if (lua_rawgetp(L, *seen, lua_topointer(L, idx)) != LUA_TNIL) {
+                lua_pop(L, 1); /* already checked (a cycle or a shared table) */
+                return;
+            }
+            lua_pop(L, 1);
+            lua_pushboolean(L, 1);
+            lua_rawsetp(L, *seen, lua_topointer(L, idx));
+
+            lua_pushnil(L);
+            while (lua_next(L, idx) != 0) {
+                checkvalue(L, -2, seen, bytes); /* check key */
+                checkvalue(L, -1, seen, bytes); /* check value */
+                lua_pop(L, 1);
+            }
+            return;
+        }
+    }
+    luaL_error(L, "cannot send a %s", luaL_typename(L, idx));
+}
+
+
+/* check all message values (from index 'first' up) before locking;
+   return (roughly) how many bytes they take */
+static size_t checkvalues (lua_State *L, int first) {
+    int n = lua_gettop(L);
+    int seen = 0;
+    size_t bytes = 0;
+    int i;
+
+    for (i = first; i <= n; i++)
+        checkvalue(L, i, &seen, &bytes);
+
+    lua_settop(L, n); /* remove the visited set, if any */
+    return bytes;
+}
+
+
+/* copy the value at 'idx' in 'send' to the top of 'rec';
+   'seen' is the index in 'rec' of a map from sender tables to
+   their copies, so that shared tables and cycles are preserved */
+static void copyvalue (lua_State *send, lua_State *rec, int idx,
+        int seen) {
+    switch (lua_type(send, idx)) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(rec, lua_toboolean(send, idx));
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(send, idx))
+                lua_pushinteger(rec, lua_tointeger(send, idx));
+            else
+                lua_pushnumber(rec, lua_tonumber(send, idx));
+            break;
+        case LUA_TSTRING: {
+            size_t len;
+            const char *s = lua_tolstring(send, idx, &len);
+            lua_pushlstring(rec, s, len);
+            break;
+        }
+        case LUA_TUSERDATA: /* a shared buffer (see 'checkvalue') */
+            pushbuffer(rec, *(SharedBuffer **)lua_touserdata(send, idx));
+            break;
+        case LUA_TTABLE: {
+            const void *t = lua_topointer(send, idx);
+
+            if (lua_rawgetp(rec, seen, t) != LUA_TNIL)
+                break; /* already copied; reuse the copy */
+            lua_pop(rec, 1);
+
+            idx = lua_absindex(send, idx);
+            luaL_checkstack(send, 3, "table too deep");
+            luaL_checkstack(rec, 4, "table too deep");
+            lua_createtable(rec, (int)lua_rawlen(send, idx), 0);
+            lua_pushvalue(rec, -1);
+            lua_rawsetp(rec, seen, t); /* seen[t] = copy */
+
+            lua_pushnil(send);
+            while (lua_next(send, idx) != 0) {
+                copyvalue(send, rec, -2, seen); /* copy key */
+                copyvalue(send, rec, -1, seen); /* copy value */
+                lua_rawset(rec, -3);
+                lua_pop(send, 1);
+            }
+            break;
+        }
+        default:
+            lua_pushnil(rec);
+            break;
+    }
+}
+
+
+/* copy values 'first'..'last' of 'send' to the top of 'rec' */
+static void copyvalues (lua_State *send, int first, int last,
+        lua_State *rec) {
+    int seen = 0;
+    int i;
+
+    luaL_checkstack(rec, last - first + 2, "too many results");
+
+    for (i = first; i <= last; i++) { /* any table to copy? */
+        if (lua_type(send, i) == LUA_TTABLE) {
+            lua_newtable(rec); /* map from sender tables to copies */
+            seen = lua_gettop(rec);
+            break;
+        }
+    }
+
+    for (i = first; i <= last; i++)
+        copyvalue(send, rec, i, seen);
+
+    if (seen != 0)
+        lua_remove(rec, seen);
+}
+
+
 static void movevalues (lua_State *send, lua_State *rec) {
-    int n = lua_gettop(send);
+    /* move all values but the channel to receiver */
+    copyvalues(send, 2, lua_gettop(send), rec);
+}
+
+
+/* a message encoded as bytes, independent of any Lua state; used
+   where values must wait in C (e.g., pool tasks and their results) */
+typedef struct Blob {
+    char *data;
+    size_t len; /* bytes in use */
+    size_t size; /* bytes allocated */
+    int ntables; /* number of tables encoded */
+} Blob;
+
+/* type tags for encoded values */
+#define B_NIL 'n'
+#define B_FALSE 'f'
+#define B_TRUE 't'
+#define B_INT 'i'
+#define B_NUM 'd'
+#define B_STR 's'
+#define B_BUF 'b' /* shared buffer (pointer) */
+#define B_TABLE '{' /* new table; pairs until B_END */
+#define B_END '}'
+#define B_REF 'r' /* table already encoded (index) */
+
+
+static int addbytes (Blob *b, const void *p, size_t n) {
+    if (b->len + n > b->size) {
+        size_t newsize = (b->size == 0) ? 64 : b->size;
+        char *newdata;
+        while (newsize < b->len + n)
+            newsize *= 2;
+        newdata = (char *)realloc(b->data, newsize);
+        if (newdata == NULL)
+            return 0;
+        b->data = newdata;
+        b->size = newsize;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 1;
+}
+
+static int addtag (Blob *b, char tag) {
+    return addbytes(b, &tag, 1);
+}
+
+
+/* encode the value at 'idx'; the value must have passed 'checkvalue'.
+   'seen' is the index of a map from tables to their encoding order.
+   Return 0 if memory runs out */
+static int encodevalue (lua_State *L, int idx, Blob *b, int seen) {
+    switch (lua_type(L, idx)) {
+        case LUA_TBOOLEAN:
+            return addtag(b, lua_toboolean(L, idx) ? B_TRUE : B_FALSE);
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, idx)) {
+                lua_Integer i = lua_tointeger(L, idx);
+                return addtag(b, B_INT) && addbytes(b, &i, sizeof(i));
+            }
+            else {
+                lua_Number n = lua_tonumber(L, idx);
+                return addtag(b, B_NUM) && addbytes(b, &n, sizeof(n));
+            }
+        case LUA_TSTRING: {
+            size_t len;
+            const char *s = lua_tolstring(L, idx, &len);
+            return addtag(b, B_STR) && addbytes(b, &len, sizeof(len)) &&
+                addbytes(b, s, len);
+        }
+        case LUA_TUSERDATA: { /* a shared buffer */
+            SharedBuffer *sb = *(SharedBuffer **)lua_touserdata(L, idx);
+            if (!(addtag(b, B_BUF) && addbytes(b, &sb, sizeof(sb))))
+                return 0;
+            atomic_fetch_add(&sb->refs, 1); /* the blob holds a reference */
+            return 1;
+        }
+        case LUA_TTABLE: {
+            const void *t = lua_topointer(L, idx);
+            int ok = 1;
+
+            if (lua_rawgetp(L, seen, t) == LUA_TNUMBER) { /* seen it? */
+                size_t ref = (size_t)lua_tointeger(L, -1);
+                lua_pop(L, 1);
+                return addtag(b, B_REF) && addbytes(b, &ref, sizeof(ref));
+            }
+            lua_pop(L, 1);
+            lua_pushinteger(L, ++b->ntables);
+            lua_rawsetp(L, seen, t);
+
+            idx = lua_absindex(L, idx);
+            luaL_checkstack(L, 3, "table too deep");
+            if (!addtag(b, B_TABLE))
+                return 0;
+            lua_pushnil(L);
+            while (ok && lua_next(L, idx) != 0) {
+                ok = encodevalue(L, -2, b, seen) &&
+                    encodevalue(L, -1, b, seen);
+                lua_pop(L, 1);
+            }
+            if (!ok) {
+                lua_pop(L, 1); /* remove the key */
+                return 0;
+            }
+            return addtag(b, B_END);
+        }
+        default:
+            return addtag(b, B_NIL);
+    }
+}
+
+
+/* encode values 'first'..top (already checked) into 'b' */
+static int encodevalues (lua_State *L, int first, Blob *b) {
+    int n = lua_gettop(L);
+    int ok = 1;
     int i;
 
-    luaL_checkstack(rec, n, "too many results");
+    lua_newtable(L); /* map from tables to their encoding order */
+    for (i = first; ok && i <= n; i++)
+        ok = encodevalue(L, i, b, n + 1);
+    lua_settop(L, n);
+    return ok;
+}
+
+
+#define getbytes(p, v) (memcpy(&(v), (p), sizeof(v)), (p) += sizeof(v))
 
-    for (i = 2; i <= n; i++) /* move values to receiver */
-        lua_pushstring(rec, lua_tostring(send, i));
+/* push the value encoded at '*p' and advance '*p' past it;
+   'refs' is the index of the list of decoded tables */
+static void decodevalue (lua_State *L, const char **p, int refs) {
+    switch (*(*p)++) {
+        case B_FALSE: lua_pushboolean(L, 0); break;
+        case B_TRUE: lua_pushboolean(L, 1); break;
+        case B_INT: {
+            lua_Integer i;
+            getbytes(*p, i);
+            lua_pushinteger(L, i);
+            break;
+        }
+        case B_NUM: {
+            lua_Number n;
+            getbytes(*p, n);
+            lua_pushnumber(L, n);
+            break;
+        }
+        case B_STR: {
+            size_t len;
+            getbytes(*p, len);
+            lua_pushlstring(L, *p, len);
+            *p += len;
+            break;
+        }
+        case B_BUF: {
+            SharedBuffer *sb;
+            getbytes(*p, sb);
+            pushbuffer(L, sb);
+            break;
+        }
+        case B_REF: {
+            size_t ref;
+            getbytes(*p, ref);
+            lua_rawgeti(L, refs, (lua_Integer)ref);
+            break;
+        }
+        case B_TABLE: {
+            luaL_checkstack(L, 4, "table too deep");
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, refs, (lua_Integer)lua_rawlen(L, refs) + 1);
+            while (**p != B_END) {
+                decodevalue(L, p, refs); /* key */
+                decodevalue(L, p, refs); /* value */
+                lua_rawset(L, -3);
+            }
+            (*p)++; /* skip B_END */
+            break;
+        }
+        default: lua_pushnil(L); break;
+    }
 }
 
 
-static Proc *searchmatch (const char *channel, Proc **list) {
-    Proc *node;
+/* push all values encoded in 'b'; return how many */
+static int decodevalues (lua_State *L, const Blob *b) {
+    const char *p = b->data;
+    const char *end = b->data + b->len;
+    int top = lua_gettop(L);
+    int refs = 0;
+
+    if (b->ntables > 0) {
+        lua_createtable(L, b->ntables, 0);
+        refs = lua_gettop(L);
+    }
+    while (p < end) {
+        luaL_checkstack(L, 1, "too many values");
+        decodevalue(L, &p, refs);
+    }
+    if (refs != 0)
+        lua_remove(L, refs);
+    return lua_gettop(L) - top;
+}
 
-    /* traverse the list */
-    for (node = *list; node != NULL; node = node->next) {
-        if (strcmp(channel, node->channel) == 0) { /* match? */
-            /* remove node from the list */
-            if (*list == node) /* is this node the first element? */
-                *list = (node->next == node) ? NULL : node->next;
 
-            node->previous->next = node->next;
-            node->next->previous = node->previous;
+/* free a blob, dropping its references to shared buffers */
+static void freeblob (Blob *b) {
+    const char *p = b->data;
+    const char *end = b->data + b->len;
 
-            return node;
+    while (p < end) {
+        switch (*p++) {
+            case B_INT: p += sizeof(lua_Integer); break;
+            case B_NUM: p += sizeof(lua_Number); break;
+            case B_STR: {
+                size_t len;
+                getbytes(p, len);
+                p += len;
+                break;
+            }
+            case B_REF: p += sizeof(size_t); break;
+            case B_BUF: {
+                SharedBuffer *sb;
+                getbytes(p, sb);
+                if (atomic_fetch_sub(&sb->refs, 1) == 1)
+                    free(sb);
+                break;
+            }
+            default: break; /* tags without payload */
         }
     }
-    return NULL; /* no match found */
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+    b->ntables = 0;
+}
+
+
+/* a buffered message; encoded, so that it holds no Lua state and its
+   shared buffers are released as soon as it is received */
+typedef struct Message {
+    Blob b;
+    struct Message *next;
+} Message;
+
+
+/* append the message in 'send' to the channel buffer; return 0 if
+   there is no memory for it. Must be called holding 'c->access' */
+static int enqueue (Channel *c, lua_State *send) {
+    Message *m = (Message *)malloc(sizeof(Message));
+
+    if (m == NULL)
+        return 0;
+    m->b.data = NULL;
+    m->b.len = m->b.size = 0;
+    m->b.ntables = 0;
+    m->next = NULL;
+    if (!encodevalues(send, 2, &m->b)) {
+        freeblob(&m->b); /* drop references taken so far */
+        free(m);
+        return 0;
+    }
+
+    if (c->last != NULL)
+        c->last->next = m;
+    else
+        c->first = m;
+    c->last = m;
+    c->tail++;
+    return 1;
+}
+
+
+/* move the oldest buffered message to 'rec';
+   must be called holding 'c->access' */
+static void unqueue (Channel *c, lua_State *rec) {
+    Message *m = c->first;
+
+    decodevalues(rec, &m->b);
+    c->first = m->next;
+    if (c->first == NULL)
+        c->last = NULL;
+    c->head++;
+    freeblob(&m->b);
+    free(m);
+}
+
+
+/* remove and return the first process in a wait list */
+static Proc *dequeue (Proc **list) {
+    Proc *node = *list;
+
+    if (node == NULL) /* empty list? */
+        return NULL;
+
+    *list = (node->next == node) ? NULL : node->next;
+    node->previous->next = node->next;
+    node->next->previous = node->previous;
+
+    return node;
+}
+
+
+/* remove a given process from a wait list */
+static void removeproc (Proc **list, Proc *p) {
+    if (*list == p)
+        *list = (p->next == p) ? NULL : p->next;
+    p->previous->next = p->next;
+    p->next->previous = p->previous;
+}
+
+
+/* compute the absolute time 'timeout' seconds from now */
+static void deadline (double timeout, struct timespec *until) {
+    double secs = floor(timeout);
+
+    clock_gettime(CLOCK_REALTIME, until);
+    until->tv_sec += (time_t)secs;
+    until->tv_nsec += (long)((timeout - secs) * 1e9);
+    if (until->tv_nsec >= 1000000000L) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000L;
+    }
 }
 
 
-static void waitonlist (lua_State *L, const char *channel,
-        Proc **list) {
+/* wait for a match, for at most 'timeout' seconds (forever, if
+   negative); return 0 on timeout. Must be called holding 'c->access' */
+static int waitonlist (lua_State *L, Channel *c, Proc **list,
+        double timeout) {
     Proc *p = getself(L);
+    struct timespec until;
+    unsigned long long t0;
+
+    if (timeout == 0) /* no waiting at all? */
+        return 0;
+
+    if (timeout > 0)
+        deadline(timeout, &until);
 
     /* link itself at the end of the list */
     if (*list == NULL) { /* empty list? */
@@ -83,126 +863,1561 @@ static void waitonlist (lua_State *L, const char *channel,
         p->previous->next = p->next->previous = p;
     }
 
-    p->channel = channel; /* waiting channel */
+    p->channel = c; /* waiting channel */
+    t0 = nowns();
     do { /* wait on its condition variable */
-        pthread_cond_wait(&p->cond, &kernel_access);
+        if (timeout < 0)
+            pthread_cond_wait(&p->cond, &c->access);
+        else if (pthread_cond_timedwait(&p->cond, &c->access,
+                    &until) == ETIMEDOUT && p->channel) {
+            removeproc(list, p); /* nobody came; give up */
+            p->channel = NULL;
+            recordwait(c, nowns() - t0);
+            return 0;
+        }
     } while (p->channel);
+
+    recordwait(c, nowns() - t0);
+    return 1;
 }
 
-static int ll_send (lua_State *L) {
+
+/* wake up a process that was waiting on a channel */
+static void wakeup (Proc *p) {
+    p->channel = NULL; /* mark it as not waiting */
+    pthread_cond_signal(&p->cond);
+}
+
+
+static void notifyselectors (Channel *c);
+
+/* send the message in 'L' (values 2..top) through 'c';
+   return 0 if it could not be delivered within 'timeout' */
+static int dosend (lua_State *L, Channel *c, double timeout) {
     Proc *p;
-    const char *channel = luaL_checkstring(L, 1);
+    int done = 1;
+    size_t bytes = checkvalues(L, 2); /* fail here, not holding the lock */
 
-    pthread_mutex_lock(&kernel_access);
+    getself(L); /* make sure it has a control block before locking */
+    lockchannel(c);
 
-    p = searchmatch(channel, &waitreceive);
+    p = dequeue(&c->waitreceive);
 
     if (p) { /* found a matching receiver? */
         movevalues(L, p->L); /* move values to receiver */
-        p->channel = NULL; /* mark receiver as not waiting */
-        pthread_cond_signal(&p->cond); /* wake it up */
+        wakeup(p);
+    }
+    else if (c->tail - c->head < c->capacity) { /* room in the buffer? */
+        if (!enqueue(c, L)) {
+            pthread_mutex_unlock(&c->access);
+            luaL_error(L, "not enough memory to buffer message");
+        }
+        notifyselectors(c);
+    }
+    else {
+        if (timeout != 0) /* it will wait in 'waitsend' */
+            notifyselectors(c);
+        done = waitonlist(L, c, &c->waitsend, timeout);
     }
-    else
-        waitonlist(L, channel, &waitsend);
 
-    pthread_mutex_unlock(&kernel_access);
-    return 0;
+    if (done) {
+        c->stats.sent++;
+        c->stats.bytes += bytes;
+    }
+    pthread_mutex_unlock(&c->access);
+    return done;
 }
 
-static int ll_receive (lua_State *L) {
-    Proc *p;
-    const char *channel = luaL_checkstring(L, 1);
-    lua_settop(L, 1);
 
-    pthread_mutex_lock(&kernel_access);
+/* receive a message from 'c' into 'L', above the current top;
+   return 0 if none arrived within 'timeout' */
+static int doreceive (lua_State *L, Channel *c, double timeout) {
+    Proc *p;
+    int done = 1;
 
-    p = searchmatch(channel, &waitsend);
+    getself(L);
+    lockchannel(c);
 
-    if (p) { /* found a matching sender? */
+    if (c->tail > c->head) { /* any buffered message? */
+        unqueue(c, L);
+        p = c->waitsend;
+        /* a blocked sender can now use the free slot (if there is no
+           memory for its message, it keeps waiting) */
+        if (p != NULL && enqueue(c, p->L)) {
+            dequeue(&c->waitsend);
+            wakeup(p);
+        }
+    }
+    else if ((p = dequeue(&c->waitsend)) != NULL) { /* a sender? */
         movevalues(p->L, L); /* get values from sender */
-        p->channel = NULL; /* mark sender as not waiting */
-        pthread_cond_signal(&p->cond); /* wake it up */
+        wakeup(p);
     }
     else
-        waitonlist(L, channel, &waitreceive);
-
-    pthread_mutex_unlock(&kernel_access);
+        done = waitonlist(L, c, &c->waitreceive, timeout);
 
-    /* return all stack values except the channel */
-    return lua_gettop(L) - 1;
+    if (done)
+        c->stats.received++;
+    pthread_mutex_unlock(&c->access);
+    return done;
 }
 
-static void registerlib (lua_State *L, const char *name,
-        lua_CFunction f) {
-    lua_getglobal(L, "package");
-    lua_getfield(L, -1, "preload"); /* get 'package.preload' */
-    lua_pushcfunction(L, f);
-    lua_setfield(L, -2, name); /* package.preload[name] = f */
-    lua_pop(L, 2); /* pop 'package' and 'preload' tables */
+
+static int ll_send (lua_State *L) {
+    dosend(L, checkchannel(L, 1), -1);
+    return 0;
 }
 
-static void openlibs (lua_State *L) {
-    luaL_requiref(L, "_G", luaopen_base, 1);
-    luaL_requiref(L, "package", luaopen_package, 1);
-    lua_pop(L, 2); /* remove results from previous calls */
+static int ll_receive (lua_State *L) {
+    Channel *c = checkchannel(L, 1);
+    lua_settop(L, 1);
 
-    registerlib(L, "coroutine", luaopen_coroutine);
-    registerlib(L, "table", luaopen_table);
-    registerlib(L, "io", luaopen_io);
-    registerlib(L, "os", luaopen_os);
-    registerlib(L, "string", luaopen_string);
-    registerlib(L, "math", luaopen_math);
-    registerlib(L, "utf8", luaopen_utf8);
-    registerlib(L, "debug", luaopen_debug);
+    doreceive(L, c, -1);
+
+    /* return all stack values except the channel */
+    return lua_gettop(L) - 1;
 }
 
-static void *ll_thread (void *arg) {
-    lua_State *L = (lua_State *)arg;
-    Proc *self; /* own control block */
+/* lproc.trysend(channel, ...): send only if that needs no waiting */
+static int ll_trysend (lua_State *L) {
+    lua_pushboolean(L, dosend(L, checkchannel(L, 1), 0));
+    return 1;
+}
 
-    openlibs(L); /* open standard libraries */
-    luaL_requiref(L, "lproc", luaopen_lproc, 1);
-    lua_pop(L, 1); /* remove result from previous call */
+/* lproc.tryreceive(channel [, timeout]): return true plus the
+   message values, or false if no message arrived in time */
+static int ll_tryreceive (lua_State *L) {
+    Channel *c = checkchannel(L, 1);
+    double timeout = luaL_optnumber(L, 2, 0);
 
-    self = (Proc *)lua_newuserdata(L, sizeof(Proc));
-    lua_setfield(L, LUA_REGISTRYINDEX, "_SELF");
-    self->L = L;
-    self->thread = pthread_self();
-    self->channel = NULL;
-    pthread_cond_init(&self->cond, NULL);
+    luaL_argcheck(L, timeout >= 0, 2, "negative timeout");
+    lua_settop(L, 1);
+    lua_pushboolean(L, 1);
 
-    if (lua_pcall(L, 0, 0, 0) != 0) /* call main chunk */
-        fprintf(stderr, "thread error: %s", lua_tostring(L, -1));
+    if (!doreceive(L, c, timeout)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
 
-    pthread_cond_destroy(&getself(L)->cond);
-    lua_close(L);
-    return NULL;
+    /* return 'true' and the received values */
+    return lua_gettop(L) - 1;
 }
 
+/*
+** Select: a 'lproc.select' call links one node into each of its
+** channels; a sender arriving at any of them marks the call as ready
+** and wakes it up. 'select' only reports the channel; the caller then
+** receives from it.
+*/
 
+typedef struct Selector {
+    pthread_mutex_t access;
+    pthread_cond_t cond;
+    Channel *ready; /* first channel that became ready */
+} Selector;
 
-static int ll_start (lua_State *L) {
-    pthread_t thread;
-    const char *chunk = luaL_checkstring(L, 1);
-    lua_State *L1 = luaL_newstate();
-
-    if (L1 == NULL)
-        luaL_error(L, "unable to create new state");
+typedef struct SelectNode {
+    Selector *sel;
+    struct SelectNode *previous, *next;
+} SelectNode;
 
-    if (luaL_loadstring(L1, chunk) != 0)
-        luaL_error(L, "error in thread body: %s",
-                lua_tostring(L1, -1));
 
-    if (pthread_create(&thread, NULL, ll_thread, L1) != 0)
-        luaL_error(L, "unable to create new thread");
+/* wake up the selects waiting on 'c'; must hold 'c->access' */
+static void notifyselectors (Channel *c) {
+    SelectNode *node;
 
-    pthread_detach(thread);
-    return 0;
+    for (node = c->selectors; node != NULL; node = node->next) {
+        Selector *sel = node->sel;
+        pthread_mutex_lock(&sel->access);
+        if (sel->ready == NULL) {
+            sel->ready = c;
+            pthread_cond_signal(&sel->cond);
+        }
+        pthread_mutex_unlock(&sel->access);
+    }
 }
 
 
+/* can a receiver get a message from 'c' without waiting?
+   must hold 'c->access' */
+static int isready (Channel *c) {
+    return c->tail > c->head || c->waitsend != NULL;
+}
+
+
+static void unlinkselector (Channel *c, SelectNode *node) {
+    lockchannel(c);
+    if (node->previous != NULL)
+        node->previous->next = node->next;
+    else
+        c->selectors = node->next;
+    if (node->next != NULL)
+        node->next->previous = node->previous;
+    pthread_mutex_unlock(&c->access);
+}
+
+
+/* lproc.select(channels [, timeout]): wait until one of the channels
+   in the list has a message to receive; return that channel and its
+   index in the list, or nil on timeout. The search starts at a
+   different channel each time, so no channel starves the others.
+   The result is only a hint: another process may take the message
+   first, so read it with 'tryreceive' and select again if that fails:
+       repeat ok, msg = lproc.tryreceive(lproc.select(chans)) until ok */
+static int ll_select (lua_State *L) {
+    double timeout = luaL_optnumber(L, 2, -1);
+    Proc *self = getself(L);
+    Channel **chans;
+    SelectNode *nodes;
+    Selector sel;
+    int n, i, k, start;
+    int found = -1;
+    int linked = 0; /* number of nodes linked into channels */
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, lua_isnoneornil(L, 2) || timeout >= 0, 2,
+            "negative timeout");
+    n = (int)luaL_len(L, 1);
+    luaL_argcheck(L, n >= 1, 1, "no channels to select");
+    lua_settop(L, 1);
+
+    chans = (Channel **)lua_newuserdatauv(L, n * sizeof(Channel *), 0);
+    nodes = (SelectNode *)lua_newuserdatauv(L, n * sizeof(SelectNode), 0);
+    for (i = 0; i < n; i++) {
+        lua_geti(L, 1, i + 1);
+        chans[i] = checkchannel(L, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+
+    pthread_mutex_init(&sel.access, NULL);
+    pthread_cond_init(&sel.cond, NULL);
+    sel.ready = NULL;
+
+    /* look for a ready channel, registering in the others on the way */
+    start = (int)(self->nextselect++ % (unsigned int)n);
+    for (k = 0; k < n && found < 0; k++) {
+        Channel *c = chans[i = (start + k) % n];
+        lockchannel(c);
+        if (isready(c))
+            found = i;
+        else if (timeout != 0) {
+            nodes[i].sel = &sel;
+            nodes[i].previous = NULL;
+            nodes[i].next = c->selectors;
+            if (c->selectors != NULL)
+                c->selectors->previous = &nodes[i];
+            c->selectors = &nodes[i];
+            linked++;
+        }
+        pthread_mutex_unlock(&c->access);
+    }
+
+    if (found < 0 && timeout != 0) { /* wait for a sender */
+        struct timespec until;
+        if (timeout > 0)
+            deadline(timeout, &until);
+        pthread_mutex_lock(&sel.access);
+        while (sel.ready == NULL) {
+            if (timeout < 0)
+                pthread_cond_wait(&sel.cond, &sel.access);
+            else if (pthread_cond_timedwait(&sel.cond, &sel.access,
+                        &until) == ETIMEDOUT)
+                break;
+        }
+        pthread_mutex_unlock(&sel.access);
+    }
+
+    for (k = 0; k < linked; k++) /* leave all channels */
+        unlinkselector(chans[(start + k) % n], &nodes[(start + k) % n]);
+
+    if (found < 0 && sel.ready != NULL) { /* find its index */
+        for (i = 0; i < n && chans[i] != sel.ready; i++)
+            ;
+        found = i;
+    }
+    pthread_cond_destroy(&sel.cond);
+    pthread_mutex_destroy(&sel.access);
+
+    if (found < 0) { /* timeout */
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_geti(L, 1, found + 1); /* the channel as given in the list */
+    lua_pushinteger(L, found + 1);
+    return 2;
+}
+
+
+/* lproc.channel(name [, capacity]): a handle that skips the name
+   lookup; a positive capacity lets senders run ahead of receivers */
+static int ll_channel (lua_State *L) {
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    lua_Integer capacity = luaL_optinteger(L, 2, -1);
+    Channel **pc;
+    Channel *c;
+
+    luaL_argcheck(L, lua_isnoneornil(L, 2) || capacity >= 0, 2,
+            "negative capacity");
+
+    pc = (Channel **)lua_newuserdata(L, sizeof(Channel *));
+    c = *pc = internchannel(L, name, len);
+    luaL_setmetatable(L, CHANNEL_MT);
+
+    if (capacity >= 0) { /* (re)configure its buffer? */
+        lockchannel(c);
+        c->capacity = capacity;
+        pthread_mutex_unlock(&c->access);
+    }
+    return 1;
+}
+
+static int channel_tostring (lua_State *L) {
+    Channel *c = *(Channel **)luaL_checkudata(L, 1, CHANNEL_MT);
+    lua_pushfstring(L, "channel(%s)", c->name);
+    return 1;
+}
+
+/* a copy of one channel's counters, taken holding its lock */
+typedef struct ChannelSnapshot {
+    const char *name; /* channels are never freed */
+    ChannelStats stats;
+    lua_Integer queued;
+    int waitingsenders, waitingreceivers;
+} ChannelSnapshot;
+
+typedef struct TableSnapshot {
+    unsigned long long acquisitions, contended, waitns, holdns;
+} TableSnapshot;
+
+
+static int countprocs (Proc *list) {
+    Proc *p = list;
+    int n = 0;
+
+    if (p != NULL) {
+        do {
+            n++;
+            p = p->next;
+        } while (p != list);
+    }
+    return n;
+}
+
+
+/* copy the counters of all channels into a new array (NULL with
+   '*n == 0' if there are none, or if memory is short) */
+static ChannelSnapshot *snapshotchannels (size_t *n) {
+    ChannelSnapshot *snap;
+    size_t i, k = 0;
+
+    locktable(0);
+    snap = (nchannels == 0) ? NULL :
+        (ChannelSnapshot *)malloc(nchannels * sizeof(ChannelSnapshot));
+    for (i = 0; snap != NULL && i < nbuckets; i++) {
+        Channel *c;
+        for (c = channels[i]; c != NULL; c = c->next) {
+            lockchannel(c);
+            snap[k].name = c->name;
+            snap[k].stats = c->stats;
+            snap[k].queued = c->tail - c->head;
+            snap[k].waitingsenders = countprocs(c->waitsend);
+            snap[k].waitingreceivers = countprocs(c->waitreceive);
+            pthread_mutex_unlock(&c->access);
+            k++;
+        }
+    }
+    pthread_rwlock_unlock(&channels_access);
+    *n = k;
+    return snap;
+}
+
+
+/* add up the channel table counters of all threads */
+static void snapshottable (TableSnapshot *t) {
+    LockStats *s;
+
+    memset(t, 0, sizeof(TableSnapshot));
+    pthread_mutex_lock(&lockstats_access);
+    for (s = lockstats; s != NULL; s = s->next) {
+        t->acquisitions += atomic_load(&s->acquisitions);
+        t->contended += atomic_load(&s->contended);
+        t->waitns += atomic_load(&s->waitns);
+        t->holdns += atomic_load(&s->holdns);
+    }
+    pthread_mutex_unlock(&lockstats_access);
+}
+
+
+static void setnumber (lua_State *L, const char *k, double v) {
+    lua_pushnumber(L, v);
+    lua_setfield(L, -2, k);
+}
+
+static void setinteger (lua_State *L, const char *k, lua_Integer v) {
+    lua_pushinteger(L, v);
+    lua_setfield(L, -2, k);
+}
+
+
+/* lproc.stats(): counters for every channel and for the channel
+   table lock; times are in seconds */
+static int ll_stats (lua_State *L) {
+    size_t n, i;
+    ChannelSnapshot *snap = snapshotchannels(&n);
+    TableSnapshot t;
+
+    snapshottable(&t);
+    lua_createtable(L, 0, 2);
+
+    lua_createtable(L, 0, (int)n);
+    for (i = 0; i < n; i++) {
+        lua_createtable(L, 0, 10);
+        setinteger(L, "sent", (lua_Integer)snap[i].stats.sent);
+        setinteger(L, "received", (lua_Integer)snap[i].stats.received);
+        setinteger(L, "bytes", (lua_Integer)snap[i].stats.bytes);
+        setinteger(L, "queued", snap[i].queued);
+        setinteger(L, "waiting_senders", snap[i].waitingsenders);
+        setinteger(L, "waiting_receivers", snap[i].waitingreceivers);
+        setnumber(L, "wait_p50", waitquantile(&snap[i].stats, 0.5));
+        setnumber(L, "wait_p99", waitquantile(&snap[i].stats, 0.99));
+        setinteger(L, "lock_contended",
+                (lua_Integer)snap[i].stats.contended);
+        setnumber(L, "lock_wait", snap[i].stats.lockwait);
+        lua_setfield(L, -2, snap[i].name);
+    }
+    free(snap); /* names still point into the channels */
+    lua_setfield(L, -2, "channels");
+
+    lua_createtable(L, 0, 4);
+    setinteger(L, "acquisitions", (lua_Integer)t.acquisitions);
+    setinteger(L, "contended", (lua_Integer)t.contended);
+    setnumber(L, "wait", t.waitns * 1e-9);
+    setnumber(L, "hold", t.holdns * 1e-9);
+    lua_setfield(L, -2, "lock");
+    return 1;
+}
+
+
+/* periodic dump of the statistics to 'stderr' */
+static pthread_mutex_t dump_access = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dumper;
+static int dumping = 0; /* is there a dumper thread? */
+static size_t dumpgen = 0; /* generation of the current dumper */
+static double dumpinterval;
+
+static void printstats (void) {
+    size_t n, i;
+    ChannelSnapshot *snap = snapshotchannels(&n);
+    TableSnapshot t;
+
+    snapshottable(&t);
+    fprintf(stderr, "lproc: table lock: %llu acquisitions, %llu contended,"
+            " wait %.6fs, hold %.6fs\n", t.acquisitions, t.contended,
+            t.waitns * 1e-9, t.holdns * 1e-9);
+    for (i = 0; i < n; i++) {
+        const ChannelSnapshot *c = &snap[i];
+        fprintf(stderr, "lproc: channel '%s': sent %llu, received %llu,"
+                " bytes %llu, queued %lld, waiting %d/%d,"
+                " wait p50 %.6fs p99 %.6fs, lock contended %llu"
+                " wait %.6fs\n", c->name, c->stats.sent,
+                c->stats.received, c->stats.bytes, (long long)c->queued,
+                c->waitingsenders, c->waitingreceivers,
+                waitquantile(&c->stats, 0.5), waitquantile(&c->stats, 0.99),
+                c->stats.contended, c->stats.lockwait);
+    }
+    free(snap);
+}
+
+/* runs until 'dumpgen' moves past its own generation, given in 'arg';
+   a dumper started after it cannot undo that */
+static void *ll_dumper (void *arg) {
+    size_t gen = (size_t)arg;
+    pthread_mutex_lock(&dump_access);
+    while (dumpgen == gen) {
+        struct timespec until;
+        deadline(dumpinterval, &until);
+        while (dumpgen == gen && pthread_cond_timedwait(&dump_cond,
+                    &dump_access, &until) != ETIMEDOUT)
+            ;
+        if (dumpgen == gen) {
+            pthread_mutex_unlock(&dump_access);
+            printstats();
+            pthread_mutex_lock(&dump_access);
+        }
+    }
+    pthread_mutex_unlock(&dump_access);
+    return NULL;
+}
+
+
+/* lproc.dumpstats(interval): print the statistics every 'interval'
+   seconds; 0 or nil stops it */
+static int ll_dumpstats (lua_State *L) {
+    double interval = luaL_optnumber(L, 1, 0);
+    int stopped = 0;
+    int started = 1;
+    pthread_t old;
+
+    luaL_argcheck(L, interval >= 0, 1, "negative interval");
+
+    pthread_mutex_lock(&dump_access);
+    if (dumping) { /* stop the current dumper */
+        old = dumper; /* only this call will join it */
+        dumping = 0;
+        dumpgen++;
+        pthread_cond_broadcast(&dump_cond);
+        stopped = 1;
+    }
+    if (interval > 0) {
+        dumpinterval = interval;
+        started = (pthread_create(&dumper, NULL, ll_dumper,
+                    (void *)dumpgen) == 0);
+        dumping = started;
+    }
+    pthread_mutex_unlock(&dump_access);
+
+    if (stopped)
+        pthread_join(old, NULL);
+    if (!started)
+        luaL_error(L, "unable to create stats thread");
+    lua_pushboolean(L, stopped);
+    return 1;
+}
+
+
+/* lproc.buffer(s): wrap a string in a buffer that is shared, not
+   copied, when sent to other processes */
+static int ll_buffer (lua_State *L) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    SharedBuffer **pb;
+    SharedBuffer *b;
+
+    /* create the userdata first, so that nothing leaks if it fails */
+    pb = (SharedBuffer **)lua_newuserdatauv(L, sizeof(SharedBuffer *), 0);
+    *pb = NULL;
+    luaL_setmetatable(L, BUFFER_MT);
+
+    b = (SharedBuffer *)malloc(sizeof(SharedBuffer) + len);
+    if (b == NULL)
+        luaL_error(L, "not enough memory for buffer");
+    atomic_init(&b->refs, 1); /* the userdata's */
+    b->len = len;
+    memcpy(b->data, s, len);
+    b->data[len] = '\0';
+    *pb = b;
+    return 1;
+}
+
+/* buffer:sub([i [, j]]): copy (part of) the buffer to a string */
+static int buffer_sub (lua_State *L) {
+    SharedBuffer *b = checkbuffer(L, 1);
+    lua_Integer len = (lua_Integer)b->len;
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    lua_Integer j = luaL_optinteger(L, 3, -1);
+
+    /* same index rules as 'string.sub' */
+    if (i < 0) i = (-i > len) ? 1 : len + i + 1;
+    else if (i == 0) i = 1;
+    if (j < 0) j = len + j + 1;
+    else if (j > len) j = len;
+
+    if (i > j)
+        lua_pushliteral(L, "");
+    else
+        lua_pushlstring(L, b->data + i - 1, (size_t)(j - i + 1));
+    return 1;
+}
+
+static int buffer_len (lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)checkbuffer(L, 1)->len);
+    return 1;
+}
+
+static int buffer_tostring (lua_State *L) {
+    lua_pushfstring(L, "buffer(%I)", (lua_Integer)checkbuffer(L, 1)->len);
+    return 1;
+}
+
+static int buffer_gc (lua_State *L) {
+    SharedBuffer *b = checkbuffer(L, 1);
+
+    /* NULL if 'll_buffer' failed to allocate it */
+    if (b != NULL && atomic_fetch_sub(&b->refs, 1) == 1) /* last ref.? */
+        free(b);
+    return 0;
+}
+
+/*
+** Code cache: chunks started (or submitted) as source are compiled
+** once; later starts of the same source load the dumped bytecode,
+** skipping the parser. Entries are immutable and never removed, so
+** they can be read without holding the lock once found.
+*/
+
+typedef struct CodeEntry {
+    unsigned int hash;
+    size_t srclen;
+    char *src; /* source, to confirm a hit */
+    Blob code; /* its bytecode */
+    struct CodeEntry *next;
+} CodeEntry;
+
+#define CODE_BUCKETS 64
+#define MAX_CACHED_CHUNKS 256
+
+static CodeEntry *codecache[CODE_BUCKETS];
+static int ncached = 0;
+static pthread_mutex_t codecache_access = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud) {
+    (void)L;
+    return !addbytes((Blob *)ud, p, sz);
+}
+
+
+/* a dumped function keeps only its code: the loaded copy gets the
+   global table as its first upvalue and nil for the others, so only
+   functions whose sole upvalue is _ENV can be shipped to a state */
+static int onlyenv (lua_State *L, int arg) {
+    const char *name;
+    int i;
+
+    for (i = 1; (name = lua_getupvalue(L, arg, i)) != NULL; i++) {
+        lua_pop(L, 1);
+        if (i > 1 || strcmp(name, "_ENV") != 0)
+            return 0;
+    }
+    return 1;
+}
+
+
+static CodeEntry *findcode (const char *src, size_t len,
+        unsigned int h) {
+    CodeEntry *e;
+
+    for (e = codecache[h % CODE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == h && e->srclen == len &&
+                memcmp(e->src, src, len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+
+/* dump the function on the top of 'L' (compiled from 'src') into
+   the cache; if anything fails the chunk is simply not cached */
+static void cachecode (lua_State *L, const char *src, size_t len,
+        unsigned int h) {
+    CodeEntry *e = (CodeEntry *)calloc(1, sizeof(CodeEntry));
+
+    if (e == NULL)
+        return;
+    e->hash = h;
+    e->srclen = len;
+    e->src = (char *)malloc(len);
+    if (e->src == NULL || lua_dump(L, writer, &e->code, 0) != 0) {
+        free(e->src);
+        free(e->code.data);
+        free(e);
+        return;
+    }
+    memcpy(e->src, src, len);
+
+    pthread_mutex_lock(&codecache_access);
+    if (ncached < MAX_CACHED_CHUNKS && findcode(src, len, h) == NULL) {
+        e->next = codecache[h % CODE_BUCKETS];
+        codecache[h % CODE_BUCKETS] = e;
+        ncached++;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&codecache_access);
+
+    if (e != NULL) { /* cache full, or someone else cached it */
+        free(e->src);
+        free(e->code.data);
+        free(e);
+    }
+}
+
+
+/* load a chunk given as source or as bytecode (e.g., the output of
+   'luac' or 'string.dump'), going through the code cache */
+static int loadchunk (lua_State *L, const char *chunk, size_t len,
+        const char *name) {
+    size_t siglen = sizeof(LUA_SIGNATURE) - 1;
+    unsigned int h;
+    CodeEntry *e;
+    int status;
+
+    if (len >= siglen && memcmp(chunk, LUA_SIGNATURE, siglen) == 0)
+        return luaL_loadbufferx(L, chunk, len, name, "b");
+
+    h = hashname(chunk, len);
+    pthread_mutex_lock(&codecache_access);
+    e = findcode(chunk, len, h);
+    pthread_mutex_unlock(&codecache_access);
+    if (e != NULL)
+        return luaL_loadbufferx(L, e->code.data, e->code.len, name, "b");
+
+    status = luaL_loadbufferx(L, chunk, len, name, "t");
+    if (status == LUA_OK)
+        cachecode(L, chunk, len, h);
+    return status;
+}
+
+
+/*
+** Preloaded modules: 'lproc.preload(name, loader)' compiles a module
+** loader once and installs it in 'package.preload' of every process
+** (and pool worker) created afterwards.
+*/
+
+typedef struct PreloadEntry {
+    Blob code; /* bytecode of the loader */
+    struct PreloadEntry *next;
+    char name[1]; /* variable part */
+} PreloadEntry;
+
+static PreloadEntry *preloads = NULL; /* newest first */
+static pthread_mutex_t preloads_access = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* the loader installed in 'package.preload' for each entry */
+static int preloader (lua_State *L) {
+    PreloadEntry *e = (PreloadEntry *)lua_touserdata(L,
+            lua_upvalueindex(1));
+    int n = lua_gettop(L);
+
+    if (luaL_loadbufferx(L, e->code.data, e->code.len, e->name, "b")
+            != LUA_OK)
+        return lua_error(L);
+    lua_insert(L, 1);
+    lua_call(L, n, LUA_MULTRET); /* call it with 'require' arguments */
+    return lua_gettop(L);
+}
+
+
+/* install the registered loaders in the package.preload table at
+   index 'preload'; a newer entry overrides an older one */
+static void installpreloads (lua_State *L, int preload) {
+    PreloadEntry *e;
+
+    pthread_mutex_lock(&preloads_access);
+    e = preloads;
+    pthread_mutex_unlock(&preloads_access);
+
+    for (; e != NULL; e = e->next) {
+        if (lua_getfield(L, preload, e->name) == LUA_TNIL) {
+            lua_pushlightuserdata(L, e);
+            lua_pushcclosure(L, preloader, 1);
+            lua_setfield(L, preload, e->name);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+
+/* lproc.preload(name, loader): 'loader' is a Lua function without
+   upvalues other than _ENV, or a chunk (source or bytecode) */
+static int ll_preload (lua_State *L) {
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    PreloadEntry *e;
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t clen;
+        const char *chunk = lua_tolstring(L, 2, &clen);
+        if (loadchunk(L, chunk, clen, name) != LUA_OK)
+            return lua_error(L);
+    }
+    else {
+        luaL_argexpected(L, lua_isfunction(L, 2) && !lua_iscfunction(L, 2),
+                2, "Lua function or chunk");
+        luaL_argcheck(L, onlyenv(L, 2), 2,
+                "Lua function without upvalues expected");
+        lua_pushvalue(L, 2);
+    }
+
+    e = (PreloadEntry *)calloc(1, sizeof(PreloadEntry) + len);
+    if (e == NULL || lua_dump(L, writer, &e->code, 0) != 0) {
+        if (e != NULL)
+            free(e->code.data);
+        free(e);
+        luaL_error(L, "not enough memory to preload '%s'", name);
+    }
+    memcpy(e->name, name, len + 1);
+
+    pthread_mutex_lock(&preloads_access);
+    e->next = preloads;
+    preloads = e;
+    pthread_mutex_unlock(&preloads_access);
+    return 0;
+}
+
+
+static void registerlib (lua_State *L, const char *name,
+        lua_CFunction f) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload"); /* get 'package.preload' */
+    lua_pushcfunction(L, f);
+    lua_setfield(L, -2, name); /* package.preload[name] = f */
+    lua_pop(L, 2); /* pop 'package' and 'preload' tables */
+}
+
+static void openlibs (lua_State *L) {
+    luaL_requiref(L, "_G", luaopen_base, 1);
+    luaL_requiref(L, "package", luaopen_package, 1);
+    lua_pop(L, 2); /* remove results from previous calls */
+
+    registerlib(L, "coroutine", luaopen_coroutine);
+    registerlib(L, "table", luaopen_table);
+    registerlib(L, "io", luaopen_io);
+    registerlib(L, "os", luaopen_os);
+    registerlib(L, "string", luaopen_string);
+    registerlib(L, "math", luaopen_math);
+    registerlib(L, "utf8", luaopen_utf8);
+    registerlib(L, "debug", luaopen_debug);
+
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    installpreloads(L, lua_gettop(L));
+    lua_pop(L, 2); /* pop 'package' and 'preload' tables */
+}
+
+/*
+** Futures: the outcome of some work running on another thread
+** (a process or a pool task), kept as a blob until someone asks
+*/
+
+#define FUTURE_MT "lproc.Future"
+
+#define FUTURE_PENDING 0
+#define FUTURE_DONE 1
+#define FUTURE_ERROR 2
+
+typedef struct Future {
+    atomic_int refs; /* its userdata plus the task computing it */
+    pthread_mutex_t access;
+    pthread_cond_t done;
+    int status;
+    Blob results; /* results, or the error object */
+    struct timespec submitted, finished; /* for 'elapsed' */
+} Future;
+
+
+static Future *newfuture (void) {
+    Future *f = (Future *)calloc(1, sizeof(Future));
+
+    if (f != NULL) {
+        atomic_init(&f->refs, 2); /* its userdata and its worker */
+        pthread_mutex_init(&f->access, NULL);
+        pthread_cond_init(&f->done, NULL);
+        f->status = FUTURE_PENDING;
+        clock_gettime(CLOCK_MONOTONIC, &f->submitted);
+    }
+    return f;
+}
+
+
+static void releasefuture (Future *f) {
+    if (atomic_fetch_sub(&f->refs, 1) == 1) { /* last reference? */
+        freeblob(&f->results);
+        pthread_cond_destroy(&f->done);
+        pthread_mutex_destroy(&f->access);
+        free(f);
+    }
+}
+
+
+/* the task's outcome is in 'f->results'; wake up whoever waits */
+static void completefuture (Future *f, int status) {
+    pthread_mutex_lock(&f->access);
+    clock_gettime(CLOCK_MONOTONIC, &f->finished);
+    f->status = status;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->access);
+    releasefuture(f);
+}
+
+
+/* store the results (values 2..top) of some work in 'f' */
+static int storeresults (lua_State *L, Future *f) {
+    checkvalues(L, 2); /* results must be sendable */
+    if (!encodevalues(L, 2, &f->results))
+        luaL_error(L, "not enough memory for results");
+    return 0;
+}
+
+
+/* store the error object on the top of the stack in 'f' */
+static void storeerror (lua_State *L, Future *f) {
+    if (!lua_isstring(L, -1))
+        lua_pushfstring(L, "(error object is a %s value)",
+                luaL_typename(L, -1));
+    freeblob(&f->results); /* discard partial results */
+    encodevalue(L, -1, &f->results, 0);
+}
+
+
+/* wait for 'f' to finish; return its status */
+static int waitfuture (Future *f) {
+    int status;
+
+    pthread_mutex_lock(&f->access);
+    while (f->status == FUTURE_PENDING)
+        pthread_cond_wait(&f->done, &f->access);
+    status = f->status;
+    pthread_mutex_unlock(&f->access);
+    return status;
+}
+
+
+static int getstatus (Future *f) {
+    int status;
+
+    pthread_mutex_lock(&f->access);
+    status = f->status;
+    pthread_mutex_unlock(&f->access);
+    return status;
+}
+
+
+/* push 'true' plus the results, or 'false' plus the error;
+   'f' must have finished */
+static int pushoutcome (lua_State *L, Future *f, int status) {
+    int top = lua_gettop(L);
+
+    lua_pushboolean(L, status == FUTURE_DONE);
+    decodevalues(L, &f->results);
+    return lua_gettop(L) - top;
+}
+
+
+/* push the seconds from submission to completion, or nil if the
+   work has not finished */
+static int pushelapsed (lua_State *L, Future *f) {
+    if (getstatus(f) == FUTURE_PENDING)
+        lua_pushnil(L);
+    else
+        lua_pushnumber(L, (double)(f->finished.tv_sec - f->submitted.tv_sec) +
+                (f->finished.tv_nsec - f->submitted.tv_nsec) * 1e-9);
+    return 1;
+}
+
+
+/* processes still running; 'lproc.exit' in the main state waits
+   for them */
+static int nprocesses = 0;
+static pthread_mutex_t processes_access = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t processes_done = PTHREAD_COND_INITIALIZER;
+
+/* error object used by 'lproc.exit' to unwind a process */
+static const char exitkey = 'x';
+
+#define PROCESS_MT "lproc.Process"
+
+typedef struct Process {
+    Future *future; /* outcome of its main chunk */
+    pthread_t thread;
+    int joined;
+} Process;
+
+#define checkprocess(L) \
+    ((Process *)luaL_checkudata(L, 1, PROCESS_MT))
+
+
+/* call the main chunk (at index 2) and store its results in the
+   future (a light userdata at index 1); called in protected mode */
+static int runchunk (lua_State *L) {
+    lua_call(L, 0, LUA_MULTRET);
+    return storeresults(L, (Future *)lua_touserdata(L, 1));
+}
+
+static void *ll_thread (void *arg) {
+    lua_State *L = (lua_State *)arg;
+    Proc *self; /* own control block */
+    Future *f;
+    int status;
+
+    openlibs(L); /* open standard libraries */
+    luaL_requiref(L, "lproc", luaopen_lproc, 1);
+    lua_pop(L, 1); /* remove result from previous call */
+
+    self = getself(L); /* create its control block */
+    lua_getfield(L, LUA_REGISTRYINDEX, "_FUTURE");
+    f = (Future *)lua_touserdata(L, -1);
+
+    lua_pushcfunction(L, runchunk);
+    lua_insert(L, 1);
+    lua_insert(L, 2); /* stack: runchunk, future, main chunk */
+    if (lua_pcall(L, 2, 0, 0) == LUA_OK) /* call main chunk */
+        status = FUTURE_DONE;
+    else if (lua_touserdata(L, -1) == (void *)&exitkey)
+        status = FUTURE_DONE; /* called 'lproc.exit' */
+    else {
+        storeerror(L, f);
+        status = FUTURE_ERROR;
+    }
+
+    pthread_cond_destroy(&self->cond);
+    lua_close(L);
+    completefuture(f, status);
+
+    pthread_mutex_lock(&processes_access);
+    if (--nprocesses == 0)
+        pthread_cond_broadcast(&processes_done);
+    pthread_mutex_unlock(&processes_access);
+    return NULL;
+}
+
+
+
+/* lproc.start(chunk): run 'chunk' (source, bytecode or a Lua
+   function without upvalues other than _ENV) in a new process; return
+   a handle to wait for it and get its results */
+static int ll_start (lua_State *L) {
+    size_t len;
+    const char *chunk, *name;
+    Process *proc;
+    lua_State *L1;
+
+    if (lua_type(L, 1) != LUA_TSTRING) { /* a function? ship its code */
+        Blob code = {NULL, 0, 0, 0};
+        luaL_argexpected(L, lua_isfunction(L, 1) && !lua_iscfunction(L, 1),
+                1, "Lua function or chunk");
+        luaL_argcheck(L, onlyenv(L, 1), 1,
+                "Lua function without upvalues expected");
+        lua_settop(L, 1);
+        if (lua_dump(L, writer, &code, 0) != 0 || code.len == 0) {
+            free(code.data);
+            luaL_error(L, "not enough memory to dump function");
+        }
+        lua_pushlstring(L, code.data, code.len);
+        free(code.data);
+        lua_replace(L, 1);
+    }
+    chunk = lua_tolstring(L, 1, &len);
+    /* source names itself, as in 'load'; bytecode would be garbage */
+    name = (len > 0 && chunk[0] == LUA_SIGNATURE[0]) ? "=(lproc.start)"
+                                                     : chunk;
+
+    proc = (Process *)lua_newuserdatauv(L, sizeof(Process), 0);
+    proc->future = NULL;
+    proc->joined = 1; /* nothing to join (yet) */
+    luaL_setmetatable(L, PROCESS_MT);
+
+    L1 = luaL_newstate();
+    if (L1 == NULL)
+        luaL_error(L, "unable to create new state");
+
+    if (loadchunk(L1, chunk, len, name) != LUA_OK) {
+        lua_pushfstring(L, "error in thread body: %s",
+                lua_tostring(L1, -1));
+        lua_close(L1);
+        lua_error(L);
+    }
+
+    proc->future = newfuture();
+    if (proc->future == NULL) {
+        lua_close(L1);
+        luaL_error(L, "not enough memory for process");
+    }
+    lua_pushlightuserdata(L1, proc->future);
+    lua_setfield(L1, LUA_REGISTRYINDEX, "_FUTURE");
+    lua_pushboolean(L1, 1);
+    lua_setfield(L1, LUA_REGISTRYINDEX, "_PROCESS");
+
+    pthread_mutex_lock(&processes_access);
+    nprocesses++;
+    pthread_mutex_unlock(&processes_access);
+
+    if (pthread_create(&proc->thread, NULL, ll_thread, L1) != 0) {
+        pthread_mutex_lock(&processes_access);
+        nprocesses--;
+        pthread_mutex_unlock(&processes_access);
+        lua_close(L1);
+        atomic_fetch_sub(&proc->future->refs, 1); /* no thread */
+        luaL_error(L, "unable to create new thread");
+    }
+    proc->joined = 0;
+    return 1;
+}
+
+
+/* threads may still be running this library's code when the main
+   state closes it, so keep it loaded until the program ends */
+static void pinlibrary (void) {
+    static int pinned = 0;
+    Dl_info info;
+
+    if (!pinned && dladdr((void *)&pinlibrary, &info) &&
+            info.dli_fname != NULL)
+        pinned = (dlopen(info.dli_fname, RTLD_NOW | RTLD_NODELETE) != NULL);
+}
+
+
+/* lproc.exit(): in a process, end it (its state is closed
+   normally); in the main state, wait for all processes to end */
 static int ll_exit (lua_State *L) {
-    pthread_exit(NULL);
+    lua_getfield(L, LUA_REGISTRYINDEX, "_PROCESS");
+    if (lua_toboolean(L, -1)) {
+        lua_pushlightuserdata(L, (void *)&exitkey);
+        return lua_error(L);
+    }
+
+    pthread_mutex_lock(&processes_access);
+    while (nprocesses > 0)
+        pthread_cond_wait(&processes_done, &processes_access);
+    pthread_mutex_unlock(&processes_access);
+    return 0;
+}
+
+
+/* proc:join(): wait for the process to end; return 'true' plus
+   the results of its main chunk, or 'false' plus its error */
+static int proc_join (lua_State *L) {
+    Process *proc = checkprocess(L);
+
+    luaL_argcheck(L, proc->future != NULL, 1, "process did not start");
+    if (!proc->joined) {
+        pthread_join(proc->thread, NULL);
+        proc->joined = 1;
+    }
+    return pushoutcome(L, proc->future, waitfuture(proc->future));
+}
+
+/* proc:result(): like 'join', but returns nil if still running */
+static int proc_result (lua_State *L) {
+    Process *proc = checkprocess(L);
+    int status;
+
+    luaL_argcheck(L, proc->future != NULL, 1, "process did not start");
+    status = getstatus(proc->future);
+    if (status == FUTURE_PENDING) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return pushoutcome(L, proc->future, status);
+}
+
+/* proc:status(): "running", "done" or "error" */
+static int proc_status (lua_State *L) {
+    static const char *const names[] = {"running", "done", "error"};
+    Process *proc = checkprocess(L);
+
+    luaL_argcheck(L, proc->future != NULL, 1, "process did not start");
+    lua_pushstring(L, names[getstatus(proc->future)]);
+    return 1;
+}
+
+/* proc:elapsed(): seconds it took, or nil if still running */
+static int proc_elapsed (lua_State *L) {
+    Process *proc = checkprocess(L);
+
+    luaL_argcheck(L, proc->future != NULL, 1, "process did not start");
+    return pushelapsed(L, proc->future);
+}
+
+static int proc_gc (lua_State *L) {
+    Process *proc = checkprocess(L);
+
+    if (!proc->joined) /* nobody will join it; let it go */
+        pthread_detach(proc->thread);
+    if (proc->future != NULL)
+        releasefuture(proc->future);
+    proc->future = NULL;
+    proc->joined = 1;
+    return 0;
+}
+
+
+/*
+** Worker pools: N long-lived states, each one running on its own
+** thread. Tasks are pushed round-robin onto per-worker deques; a
+** worker takes the oldest task of its own deque and, when that is
+** empty, steals the newest task from another worker.
+*/
+
+#define POOL_MT "lproc.Pool"
+
+typedef struct Task {
+    Blob code; /* source or bytecode of the function to run */
+    Blob args;
+    Future *future;
+} Task;
+
+typedef struct Worker {
+    pthread_mutex_t access; /* protects its deque */
+    Task **tasks; /* circular deque */
+    size_t first, count, size;
+    lua_State *L;
+    pthread_t thread;
+    struct Pool *pool;
+} Worker;
+
+typedef struct Pool {
+    pthread_mutex_t access; /* protects 'pending' and 'closing' */
+    pthread_cond_t wakeup; /* signaled when there are new tasks */
+    long pending; /* tasks waiting in the deques */
+    int closing;
+    atomic_int nworkers; /* workers running (grows while starting) */
+    atomic_uint next; /* worker to receive the next task */
+    Worker workers[1]; /* variable part */
+} Pool;
+
+
+static void freetask (Task *t) {
+    free(t->code.data); /* plain bytes, not encoded values */
+    freeblob(&t->args);
+    free(t);
+}
+
+
+/* fail a task that will never run */
+static void canceltask (Task *t) {
+    const char *msg = "pool is closed";
+    size_t len = strlen(msg);
+    Blob *r = &t->future->results;
+
+    if (addtag(r, B_STR) && addbytes(r, &len, sizeof(len)))
+        addbytes(r, msg, len);
+    completefuture(t->future, FUTURE_ERROR);
+    freetask(t);
+}
+
+
+static int pushtask (Worker *w, Task *t) {
+    int ok = 1;
+
+    pthread_mutex_lock(&w->access);
+    if (w->count == w->size) { /* deque full? grow it */
+        size_t newsize = (w->size == 0) ? 16 : 2 * w->size;
+        Task **newtasks = (Task **)malloc(newsize * sizeof(Task *));
+        size_t i;
+
+        if (newtasks == NULL)
+            ok = 0;
+        else {
+            for (i = 0; i < w->count; i++)
+                newtasks[i] = w->tasks[(w->first + i) % w->size];
+            free(w->tasks);
+            w->tasks = newtasks;
+            w->first = 0;
+            w->size = newsize;
+        }
+    }
+    if (ok)
+        w->tasks[(w->first + w->count++) % w->size] = t;
+    pthread_mutex_unlock(&w->access);
+    return ok;
+}
+
+
+/* take the oldest task (owner) or the newest one (thief) */
+static Task *poptask (Worker *w, int steal) {
+    Task *t = NULL;
+
+    pthread_mutex_lock(&w->access);
+    if (w->count > 0) {
+        if (steal)
+            t = w->tasks[(w->first + w->count - 1) % w->size];
+        else {
+            t = w->tasks[w->first];
+            w->first = (w->first + 1) % w->size;
+        }
+        w->count--;
+    }
+    pthread_mutex_unlock(&w->access);
+    return t;
+}
+
+
+/* get the next task for 'w', waiting if there is none;
+   return NULL when the pool is closing */
+static Task *nexttask (Worker *w) {
+    Pool *pool = w->pool;
+    int self = (int)(w - pool->workers);
+
+    for (;;) {
+        Task *t = poptask(w, 0);
+        int nworkers = atomic_load(&pool->nworkers);
+        int closing;
+        int i;
+
+        for (i = 1; t == NULL && i < nworkers; i++)
+            t = poptask(&pool->workers[(self + i) % nworkers], 1);
+
+        pthread_mutex_lock(&pool->access);
+        if (t != NULL)
+            pool->pending--;
+        else {
+            while (pool->pending == 0 && !pool->closing)
+                pthread_cond_wait(&pool->wakeup, &pool->access);
+        }
+        if (pool->closing) { /* put it back; 'closepool' cancels it */
+            if (t != NULL) {
+                pool->pending++;
+                pushtask(w, t);
+            }
+            t = NULL;
+        }
+        closing = pool->closing;
+        pthread_mutex_unlock(&pool->access);
+
+        if (t != NULL || closing)
+            return t;
+    }
+}
+
+
+/* run a task; called in protected mode with the task as a light
+   userdata at index 1 */
+static int runtask (lua_State *L) {
+    Task *t = (Task *)lua_touserdata(L, 1);
+
+    if (loadchunk(L, t->code.data, t->code.len, "=(pool task)") != LUA_OK)
+        return lua_error(L);
+    lua_call(L, decodevalues(L, &t->args), LUA_MULTRET);
+    return storeresults(L, t->future);
+}
+
+
+static void *ll_worker (void *arg) {
+    Worker *w = (Worker *)arg;
+    lua_State *L = w->L;
+    Task *t;
+
+    while ((t = nexttask(w)) != NULL) {
+        int status;
+
+        lua_pushcfunction(L, runtask);
+        lua_pushlightuserdata(L, t);
+        if (lua_pcall(L, 1, 0, 0) == LUA_OK)
+            status = FUTURE_DONE;
+        else {
+            storeerror(L, t->future);
+            status = FUTURE_ERROR;
+        }
+        lua_settop(L, 0);
+        completefuture(t->future, status);
+        freetask(t);
+    }
+    return NULL;
+}
+
+
+/* stop all workers and cancel the tasks that did not start */
+static void closepool (Pool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->access);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->access);
+
+    /* join them all before freeing anything: until then, any of them
+       may still be stealing from the others' deques */
+    for (i = 0; i < atomic_load(&pool->nworkers); i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (i = 0; i < atomic_load(&pool->nworkers); i++) {
+        Worker *w = &pool->workers[i];
+        Task *t;
+
+        lua_close(w->L);
+        while ((t = poptask(w, 0)) != NULL)
+            canceltask(t);
+        free(w->tasks);
+        pthread_mutex_destroy(&w->access);
+    }
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->access);
+    free(pool);
+}
+
+
+#define checkpool(L) \
+    ((Pool **)luaL_checkudata(L, 1, POOL_MT))
+#define checkfuture(L) \
+    (*(Future **)luaL_checkudata(L, 1, FUTURE_MT))
+
+/* lproc.pool(n): create a pool with 'n' workers */
+static int ll_pool (lua_State *L) {
+    int n = (int)luaL_checkinteger(L, 1);
+    Pool **pp;
+    Pool *pool;
+
+    luaL_argcheck(L, n >= 1, 1, "invalid number of workers");
+
+    /* create the userdata first, so that '__gc' cleans up
+       whatever was created if something goes wrong */
+    pp = (Pool **)lua_newuserdatauv(L, sizeof(Pool *), 0);
+    *pp = NULL;
+    luaL_setmetatable(L, POOL_MT);
+
+    pool = (Pool *)calloc(1, sizeof(Pool) + (n - 1) * sizeof(Worker));
+    if (pool == NULL)
+        luaL_error(L, "not enough memory for pool");
+    pthread_mutex_init(&pool->access, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->nworkers, 0);
+    *pp = pool;
+
+    while (atomic_load(&pool->nworkers) < n) {
+        Worker *w = &pool->workers[atomic_load(&pool->nworkers)];
+        lua_State *L1 = luaL_newstate();
+
+        if (L1 == NULL)
+            luaL_error(L, "unable to create new state");
+        openlibs(L1);
+        luaL_requiref(L1, "lproc", luaopen_lproc, 1);
+        lua_pop(L1, 1);
+
+        pthread_mutex_init(&w->access, NULL);
+        w->L = L1;
+        w->pool = pool;
+        if (pthread_create(&w->thread, NULL, ll_worker, w) != 0) {
+            lua_close(L1);
+            pthread_mutex_destroy(&w->access);
+            luaL_error(L, "unable to create new thread");
+        }
+        /* running workers may already read it; publish this one only
+           now that it is complete */
+        atomic_fetch_add(&pool->nworkers, 1);
+    }
+    return 1;
+}
+
+
+/* pool:submit(f, ...): run 'f' (a Lua function without upvalues
+   other than _ENV, or a chunk) with the given arguments on some
+   worker; return a future for its results */
+static int pool_submit (lua_State *L) {
+    Pool *pool = *checkpool(L);
+    Future **pf;
+    Task *t;
+    Worker *w;
+    int ok;
+
+    luaL_argcheck(L, pool != NULL, 1, "pool is closed");
+    luaL_argexpected(L, lua_type(L, 2) == LUA_TSTRING ||
+            (lua_isfunction(L, 2) && !lua_iscfunction(L, 2)), 2,
+            "Lua function or chunk");
+    luaL_argcheck(L, lua_type(L, 2) == LUA_TSTRING || onlyenv(L, 2), 2,
+            "Lua function without upvalues expected");
+    checkvalues(L, 3);
+
+    pf = (Future **)lua_newuserdatauv(L, sizeof(Future *), 0);
+    *pf = NULL;
+    luaL_setmetatable(L, FUTURE_MT);
+    lua_insert(L, 3); /* keep it below the arguments */
+
+    t = (Task *)calloc(1, sizeof(Task));
+    *pf = newfuture();
+    if (t == NULL || *pf == NULL) {
+        free(t);
+        if (*pf != NULL) { /* nobody else will release it */
+            atomic_fetch_sub(&(*pf)->refs, 1);
+            releasefuture(*pf);
+            *pf = NULL;
+        }
+        luaL_error(L, "not enough memory for task");
+    }
+    t->future = *pf;
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t len;
+        const char *s = lua_tolstring(L, 2, &len);
+        ok = addbytes(&t->code, s, len);
+    }
+    else {
+        lua_pushvalue(L, 2);
+        ok = (lua_dump(L, writer, &t->code, 0) == 0);
+        lua_pop(L, 1);
+    }
+    ok = ok && encodevalues(L, 4, &t->args);
+
+    w = &pool->workers[atomic_fetch_add(&pool->next, 1) %
+        (unsigned int)atomic_load(&pool->nworkers)];
+
+    /* count it before it is visible, so that a worker taking it at
+       once cannot drive 'pending' below zero */
+    pthread_mutex_lock(&pool->access);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->access);
+    if (!ok || !pushtask(w, t)) {
+        pthread_mutex_lock(&pool->access);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->access);
+        freetask(t);
+        releasefuture(*pf);
+        luaL_error(L, "not enough memory for task");
+    }
+
+    pthread_mutex_lock(&pool->access);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->access);
+
+    lua_settop(L, 3);
+    return 1;
+}
+
+static int pool_close (lua_State *L) {
+    Pool **pp = checkpool(L);
+
+    if (*pp != NULL) {
+        closepool(*pp);
+        *pp = NULL; /* avoids closing it again */
+    }
+    return 0;
+}
+
+static int pool_tostring (lua_State *L) {
+    Pool *pool = *checkpool(L);
+
+    if (pool == NULL)
+        lua_pushliteral(L, "pool (closed)");
+    else
+        lua_pushfstring(L, "pool(%d)", atomic_load(&pool->nworkers));
+    return 1;
+}
+
+
+/* future:get(): wait for the task and return its results, or
+   raise its error */
+static int future_get (lua_State *L) {
+    Future *f = checkfuture(L);
+    int status = waitfuture(f);
+
+    lua_settop(L, 1);
+    decodevalues(L, &f->results);
+    if (status == FUTURE_ERROR)
+        return lua_error(L);
+    return lua_gettop(L) - 1;
+}
+
+/* future:ready(): true if the task has finished */
+static int future_ready (lua_State *L) {
+    lua_pushboolean(L, getstatus(checkfuture(L)) != FUTURE_PENDING);
+    return 1;
+}
+
+/* future:elapsed(): seconds from submission to completion */
+static int future_elapsed (lua_State *L) {
+    return pushelapsed(L, checkfuture(L));
+}
+
+static int future_gc (lua_State *L) {
+    Future **pf = (Future **)luaL_checkudata(L, 1, FUTURE_MT);
+
+    if (*pf != NULL) {
+        releasefuture(*pf);
+        *pf = NULL;
+    }
     return 0;
 }
 
@@ -0,0 +1,49 @@
+-- compare per-bit loops in Lua with the bulk operations of arraylib:
+--     lua bench_array.lua 1000000
+local array = require "arraylib"
+
+local N = tonumber(arg and arg[1]) or 1000000 -- bits per array
+
+local a, b = array.new(N), array.new(N)
+for i = 1, N, 3 do a[i] = true end
+for i = 1, N, 5 do b[i] = true end
+
+local function run (name, f)
+    local t0 = os.clock()
+    local r = f()
+    print(string.format("%-24s %7.3fs  %s", name, os.clock() - t0, r))
+end
+
+run("count, per bit", function ()
+    local n = 0
+    for i = 1, N do if a[i] then n = n + 1 end end
+    return n
+end)
+run("count", function () return a:count() end)
+
+run("and, per bit", function ()
+    local c = array.new(N)
+    for i = 1, N do c[i] = a[i] and b[i] end
+    return c:count()
+end)
+run("and", function ()
+    return array.new(N):bor(a):band(b):count()
+end)
+
+run("setrange, per bit", function ()
+    local c = array.new(N)
+    for i = 1, N do c[i] = true end
+    return c:count()
+end)
+run("setrange", function () return array.new(N):setrange(1):count() end)
+
+run("scan set bits, per bit", function ()
+    local n = 0
+    for i = 1, N do if b[i] then n = n + 1 end end
+    return n
+end)
+run("scan set bits, nextset", function ()
+    local n, i = 0, b:nextset()
+    while i do n = n + 1; i = b:nextset(i + 1) end
+    return n
+end)
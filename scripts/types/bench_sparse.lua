@@ -0,0 +1,80 @@
+-- sparse arrays against dense ones:
+--     lua bench_sparse.lua 1000000
+-- ids are drawn from the first 2^28 indices (a dense array of that
+-- size takes 32 MB)
+local array = require "arraylib"
+
+local N = tonumber(arg and arg[1]) or 1000000 -- ids per set
+local SIZE = 2^28
+
+local function run (name, f)
+    local t0 = os.clock()
+    local r = f()
+    print(string.format("%-30s %7.3fs  %s", name, os.clock() - t0, r))
+end
+
+math.randomseed(42)
+local ids1, ids2 = {}, {}
+for i = 1, N do
+    ids1[i] = math.random(SIZE)
+    ids2[i] = math.random(SIZE // 2) -- denser, in the lower half
+end
+
+local d1, d2, s1, s2
+run("dense, fill", function ()
+    d1, d2 = array.new(SIZE), array.new(SIZE)
+    for i = 1, N do d1[ids1[i]] = true; d2[ids2[i]] = true end
+    return d1:count() + d2:count()
+end)
+run("sparse, fill", function ()
+    s1, s2 = array.sparse(SIZE), array.sparse(SIZE)
+    for i = 1, N do s1[ids1[i]] = true; s2[ids2[i]] = true end
+    return s1:count() + s2:count()
+end)
+run("sparse, serialized size", function ()
+    return string.format("%.1f MB + %.1f MB (dense: %d MB each)",
+            #s1:serialize() / 2^20, #s2:serialize() / 2^20, SIZE // 8 // 2^20)
+end)
+
+run("dense, union", function ()
+    return array.new(SIZE):bor(d1):bor(d2):count()
+end)
+run("sparse, union", function ()
+    return array.unserialize(s1:serialize()):bor(s2):count()
+end)
+run("dense, intersection", function ()
+    return array.new(SIZE):bor(d1):band(d2):count()
+end)
+run("sparse, intersection", function ()
+    return array.unserialize(s1:serialize()):band(s2):count()
+end)
+
+run("dense, iterate (nextset)", function ()
+    local n, i = 0, d1:nextset()
+    while i do n = n + 1; i = d1:nextset(i + 1) end
+    return n
+end)
+run("sparse, iterate (bits)", function ()
+    local n = 0
+    for _ in s1:bits() do n = n + 1 end
+    return n
+end)
+
+run("sparse, 2^32 bits, 1000 ids", function ()
+    local s = array.sparse()
+    for i = 1, 1000 do s[math.random(2^32)] = true end
+    return string.format("%d bytes serialized", #s:serialize())
+end)
+run("sparse, ranges", function ()
+    local s = array.sparse(SIZE)
+    for i = 1, SIZE, 4096 do s:setrange(i, i + 999) end
+    return string.format("%d bytes serialized", #s:serialize())
+end)
+run("sparse, optimize into runs", function ()
+    local s = array.sparse(SIZE)
+    for i = 1, SIZE // 16, 4096 do
+        for k = i, i + 99 do s[k] = true end
+    end
+    local before = #s:serialize()
+    return string.format("%d -> %d bytes", before, #s:optimize():serialize())
+end)
@@ -0,0 +1,69 @@
+-- typed arrays against Lua tables of numbers:
+--     lua bench_typed.lua 1000000
+local array = require "arraylib"
+
+local N = tonumber(arg and arg[1]) or 1000000 -- elements
+
+local function run (name, f)
+    local t0 = os.clock()
+    local r = f()
+    print(string.format("%-24s %7.3fs  %s", name, os.clock() - t0, r))
+end
+
+math.randomseed(42)
+local t, u = {}, {}
+for i = 1, N do t[i] = math.random(); u[i] = math.random() end
+local a, b = array.typed("float64", t), array.typed("float64", u)
+
+run("sum, table", function ()
+    local s = 0
+    for i = 1, N do s = s + t[i] end
+    return s
+end)
+run("sum", function () return a:sum() end)
+
+run("dot, table", function ()
+    local s = 0
+    for i = 1, N do s = s + t[i] * u[i] end
+    return s
+end)
+run("dot", function () return a:dot(b) end)
+
+run("max, table", function ()
+    local m = t[1]
+    for i = 2, N do if t[i] > m then m = t[i] end end
+    return m
+end)
+run("max", function () return a:max() end)
+
+run("add + scale, table", function ()
+    local c = {}
+    for i = 1, N do c[i] = (t[i] + u[i]) * 0.5 end
+    return c[N]
+end)
+run("add + scale", function ()
+    return array.typed("float64", N):add(a):add(b):mul(0.5)[N]
+end)
+
+run("prefix sums, table", function ()
+    local c, s = {}, 0
+    for i = 1, N do s = s + t[i]; c[i] = s end
+    return c[N]
+end)
+run("prefix sums", function ()
+    return array.typed("float64", N):add(a):cumsum()[N]
+end)
+
+run("sort, table.sort", function ()
+    local c = table.move(t, 1, N, 1, {})
+    table.sort(c)
+    return c[1]
+end)
+run("sort", function ()
+    return array.typed("float64", N):add(a):sort()[1]
+end)
+
+local ia = array.typed("int32", N)
+for i = 1, N do ia[i] = math.random(-1000, 1000) end
+run("int32 sum", function () return ia:sum() end)
+run("int32 add", function () return ia:add(ia):sum() end)
@@ -3,12 +3,24 @@
 
 int array2string (lua_State *L) {
     BitArray *a = checkarray(L);
-    lua_pushfstring(L, "array(%d)", a->size);
+    lua_pushfstring(L, "array(%I)", a->size);
     return 1;
 }
 
 static const struct luaL_Reg func_list_f [] = {
     {"new", newarray},
+    {"count", countarray},
+    {"band", andarray},
+    {"bor", orarray},
+    {"bxor", xorarray},
+    {"bnot", notarray},
+    {"setrange", setrange},
+    {"clearrange", clearrange},
+    {"nextset", nextset},
+    {"nextclear", nextclear},
+    {"sparse", newsparse},
+    {"unserialize", unserializesparse},
+    {"typed", newnumarray},
     {NULL, NULL} /* sentinel */
 };
 
@@ -20,10 +32,69 @@ static const struct luaL_Reg func_list_m [] = {
     {NULL, NULL} /* sentinel */
 };
 
+static const struct luaL_Reg sparse_list_f [] = {
+    {"count", countsparse},
+    {"bor", orsparse},
+    {"band", andsparse},
+    {"setrange", setrangesparse},
+    {"clearrange", clearrangesparse},
+    {"nextset", nextsetsparse},
+    {"bits", bitssparse},
+    {"optimize", optimizesparse},
+    {"serialize", serializesparse},
+    {NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg numarray_list_f [] = {
+    {"type", typenumarray},
+    {"totable", totablenumarray},
+    {"sum", sumnumarray},
+    {"dot", dotnumarray},
+    {"min", minnumarray},
+    {"max", maxnumarray},
+    {"add", addnumarray},
+    {"sub", subnumarray},
+    {"mul", mulnumarray},
+    {"div", divnumarray},
+    {"fill", fillnumarray},
+    {"cumsum", cumsumnumarray},
+    {"sort", sortnumarray},
+    {NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg numarray_list_m [] = {
+    {"__newindex", setnumarray},
+    {"__index", getnumarray},
+    {"__len", sizenumarray},
+    {"__tostring", numarray2string},
+    {NULL, NULL} /* sentinel */
+};
+
+static const struct luaL_Reg sparse_list_m [] = {
+    {"__newindex", setsparse},
+    {"__index", getsparse},
+    {"__len", sizesparse},
+    {"__tostring", sparse2string},
+    {"__gc", gcsparse},
+    {NULL, NULL} /* sentinel */
+};
+
 int luaopen_arraylib (lua_State *L) {
-    luaL_newmetatable(L, "LuaBook.array"); /* create metatable */
-    luaL_setfuncs(L, func_list_m, 0); /* register metamethods */
     luaL_newlib(L, func_list_f); /* create lib table */
+    luaL_newmetatable(L, "LuaBook.array"); /* create metatable */
+    lua_pushvalue(L, -2); /* methods are looked up in the library */
+    luaL_setfuncs(L, func_list_m, 1); /* register metamethods */
+    lua_pop(L, 1); /* pop metatable */
+
+    luaL_newmetatable(L, "LuaBook.sparse");
+    luaL_newlib(L, sparse_list_f); /* methods of sparse arrays */
+    luaL_setfuncs(L, sparse_list_m, 1); /* register metamethods */
+    lua_pop(L, 1); /* pop metatable */
+
+    luaL_newmetatable(L, "LuaBook.numarray");
+    luaL_newlib(L, numarray_list_f); /* methods of typed arrays */
+    luaL_setfuncs(L, numarray_list_m, 1); /* register metamethods */
+    lua_pop(L, 1); /* pop metatable */
 
     return 1;
 }
@@ -3,43 +3,68 @@
 
 
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 
-#define BITS_PER_WORD (CHAR_BIT * sizeof(unsigned int))
-#define I_WORD(i) ((unsigned int)(i) / BITS_PER_WORD)
-#define I_BIT(i) (1 << ((unsigned int)(i) % BITS_PER_WORD))
+/* bits are kept in 64-bit words; the loops over whole words below are
+   simple enough for the compiler to vectorize */
+#define BITS_PER_WORD 64
+#define I_WORD(i) ((size_t)(i) / BITS_PER_WORD)
+#define I_BIT(i) ((uint64_t)1 << ((size_t)(i) % BITS_PER_WORD))
+#define NWORDS(n) (I_WORD((n) - 1) + 1)
 #define checkarray(L) \
     (BitArray *)luaL_checkudata(L, 1, "LuaBook.array")
 
+#if defined(__GNUC__)
+#define popcount64(w) __builtin_popcountll(w)
+#define ctz64(w) __builtin_ctzll(w) /* 'w' must not be 0 */
+#else
+static int popcount64 (uint64_t w) {
+    int n = 0;
+    for (; w != 0; w &= w - 1) /* clear the lowest set bit */
+        n++;
+    return n;
+}
+static int ctz64 (uint64_t w) {
+    int n = 0;
+    for (; (w & 1) == 0; w >>= 1)
+        n++;
+    return n;
+}
+#endif
+
 typedef struct BitArray {
-    int size;
-    unsigned int values[1]; /* variable part */
+    lua_Integer size;
+    uint64_t values[1]; /* variable part */
 } BitArray;
 
 static int newarray (lua_State *L) {
-    int i;
     size_t nbytes;
     BitArray *a;
 
-    int n = (int)luaL_checkinteger(L, 1); /* number of bits */
-    luaL_argcheck(L, n >= 1, 1, "invalid size");
-    nbytes = sizeof(BitArray) + I_WORD(n - 1)*sizeof(unsigned int);
+    lua_Integer n = luaL_checkinteger(L, 1); /* number of bits */
+    luaL_argcheck(L, n >= 1 &&
+            (size_t)n <= (SIZE_MAX - sizeof(BitArray)) / CHAR_BIT, 1,
+            "invalid size");
+    nbytes = sizeof(BitArray) + I_WORD(n - 1)*sizeof(uint64_t);
     a = (BitArray *)lua_newuserdata(L, nbytes);
     a->size = n;
-    for (i = 0; i <= I_WORD(n - 1); i++)
-        a->values[i] = 0; /* initialize array */
+    memset(a->values, 0, NWORDS(n) * sizeof(uint64_t)); /* initialize */
 
     luaL_getmetatable(L, "LuaBook.array");
     lua_setmetatable(L, -2);
     return 1; /* new userdata is already on the stack */
 }
 
-static unsigned int *getparams (lua_State *L,
-        unsigned int *mask) {
+static uint64_t *getparams (lua_State *L,
+        uint64_t *mask) {
     BitArray *a = checkarray(L);
-    int index = (int)luaL_checkinteger(L, 2) - 1;
+    lua_Integer index = luaL_checkinteger(L, 2) - 1;
 
     luaL_argcheck(L, 0 <= index && index < a->size, 2,
             "index out of range");
@@ -49,8 +74,8 @@ static unsigned int *getparams (lua_State *L,
 }
 
 static int setarray (lua_State *L) {
-    unsigned int mask;
-    unsigned int *entry = getparams(L, &mask);
+    uint64_t mask;
+    uint64_t *entry = getparams(L, &mask);
     luaL_checkany(L, 3);
     if (lua_toboolean(L, 3))
         *entry |= mask;
@@ -60,9 +85,16 @@ static int setarray (lua_State *L) {
     return 0;
 }
 static int getarray (lua_State *L) {
-    unsigned int mask;
-    unsigned int *entry = getparams(L, &mask);
-    lua_pushboolean(L, *entry & mask);
+    uint64_t mask;
+    uint64_t *entry;
+
+    if (lua_type(L, 2) == LUA_TSTRING) { /* a method? */
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1)); /* the library */
+        return 1;
+    }
+    entry = getparams(L, &mask);
+    lua_pushboolean(L, (*entry & mask) != 0);
 
     return 1;
 }
@@ -73,4 +105,1577 @@ static int getsize (lua_State *L) {
     return 1;
 }
 
+
+/*
+** Bulk operations. Bits past 'size' in the last word are always 0,
+** so whole words can be counted and combined.
+*/
+
+/* mask of the valid bits in the last word */
+static uint64_t lastmask (const BitArray *a) {
+    unsigned int r = (unsigned int)(a->size % BITS_PER_WORD);
+    return (r == 0) ? ~(uint64_t)0 : ((uint64_t)1 << r) - 1;
+}
+
+/* a:count(): number of bits set */
+static int countarray (lua_State *L) {
+    BitArray *a = checkarray(L);
+    size_t i, nw = NWORDS(a->size);
+    lua_Integer n = 0;
+
+    for (i = 0; i < nw; i++)
+        n += popcount64(a->values[i]);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/* the second operand of a binary operation, of the same size */
+static BitArray *checkother (lua_State *L, BitArray *a) {
+    BitArray *b = (BitArray *)luaL_checkudata(L, 2, "LuaBook.array");
+    luaL_argcheck(L, b->size == a->size, 2, "arrays of different sizes");
+    return b;
+}
+
+/* a:band(b), a:bor(b), a:bxor(b): combine 'b' into 'a'; return 'a' */
+static int andarray (lua_State *L) {
+    BitArray *a = checkarray(L);
+    BitArray *b = checkother(L, a);
+    size_t i, nw = NWORDS(a->size);
+
+    for (i = 0; i < nw; i++)
+        a->values[i] &= b->values[i];
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int orarray (lua_State *L) {
+    BitArray *a = checkarray(L);
+    BitArray *b = checkother(L, a);
+    size_t i, nw = NWORDS(a->size);
+
+    for (i = 0; i < nw; i++)
+        a->values[i] |= b->values[i];
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int xorarray (lua_State *L) {
+    BitArray *a = checkarray(L);
+    BitArray *b = checkother(L, a);
+    size_t i, nw = NWORDS(a->size);
+
+    for (i = 0; i < nw; i++)
+        a->values[i] ^= b->values[i];
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* a:bnot(): flip all bits of 'a'; return 'a' */
+static int notarray (lua_State *L) {
+    BitArray *a = checkarray(L);
+    size_t i, nw = NWORDS(a->size);
+
+    for (i = 0; i < nw; i++)
+        a->values[i] = ~a->values[i];
+    a->values[nw - 1] &= lastmask(a);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* set (or clear) bits i..j (0-based) of the words in 'w' */
+static void fillwords (uint64_t *w, size_t i, size_t j, int set) {
+    size_t wi = I_WORD(i), wj = I_WORD(j);
+    uint64_t first = ~(uint64_t)0 << (i % BITS_PER_WORD);
+    uint64_t last = ~(uint64_t)0 >> (BITS_PER_WORD - 1 - j % BITS_PER_WORD);
+
+    if (wi == wj)
+        first &= last;
+    if (set) {
+        w[wi] |= first;
+        if (wi != wj) {
+            memset(&w[wi + 1], 0xff, (wj - wi - 1) * sizeof(uint64_t));
+            w[wj] |= last;
+        }
+    }
+    else {
+        w[wi] &= ~first;
+        if (wi != wj) {
+            memset(&w[wi + 1], 0, (wj - wi - 1) * sizeof(uint64_t));
+            w[wj] &= ~last;
+        }
+    }
+}
+
+/* index of the first 1 bit of 'w[k] ^ flip' from bit 'i' on, among
+   'nw' words, or -1 */
+static lua_Integer nextbit (const uint64_t *w, size_t nw, size_t i,
+        uint64_t flip) {
+    size_t k = I_WORD(i);
+    uint64_t bits = (w[k] ^ flip) & (~(uint64_t)0 << (i % BITS_PER_WORD));
+
+    while (bits == 0 && ++k < nw)
+        bits = w[k] ^ flip;
+    if (bits == 0)
+        return -1;
+    return (lua_Integer)(k * BITS_PER_WORD) + ctz64(bits);
+}
+
+/* a:setrange(i [, j]) and a:clearrange(i [, j]): bits i..j, which
+   default to the end of the array */
+static int rangearray (lua_State *L, int set) {
+    BitArray *a = checkarray(L);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, a->size);
+
+    luaL_argcheck(L, 1 <= i && i <= a->size, 2, "index out of range");
+    luaL_argcheck(L, 1 <= j && j <= a->size, 3, "index out of range");
+    if (i <= j)
+        fillwords(a->values, (size_t)(i - 1), (size_t)(j - 1), set);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int setrange (lua_State *L) {
+    return rangearray(L, 1);
+}
+
+static int clearrange (lua_State *L) {
+    return rangearray(L, 0);
+}
+
+/* a:nextset([i]) and a:nextclear([i]): index of the first bit from
+   'i' (default 1) on that is set (clear), or nil */
+static int nextarray (lua_State *L, int set) {
+    BitArray *a = checkarray(L);
+    lua_Integer i = luaL_optinteger(L, 2, 1) - 1;
+    uint64_t flip = set ? 0 : ~(uint64_t)0; /* look for 1s in w ^ flip */
+
+    luaL_argcheck(L, 0 <= i, 2, "index out of range");
+    if (i >= a->size)
+        return 0;
+    i = nextbit(a->values, NWORDS(a->size), (size_t)i, flip);
+    if (i < 0 || i >= a->size) /* none, or a clear bit past the end? */
+        return 0;
+    lua_pushinteger(L, i + 1);
+    return 1;
+}
+
+static int nextset (lua_State *L) {
+    return nextarray(L, 1);
+}
+
+static int nextclear (lua_State *L) {
+    return nextarray(L, 0);
+}
+
+
+/*
+** Sparse arrays. Bit indices are split into chunks of 64K, and each
+** chunk with bits set has a container, in one of three forms: a sorted
+** array of the low 16 bits of its indices (up to SP_ARRAYMAX of them),
+** a bitmap of 65536 bits, or a sorted list of runs. Containers are
+** kept sorted by chunk. An empty container (n == 0) can be left behind
+** by an error, so everything must accept it.
+*/
+
+#define checksparse(L) \
+    (SparseArray *)luaL_checkudata(L, 1, "LuaBook.sparse")
+
+#define SP_ARRAY 0
+#define SP_BITMAP 1
+#define SP_RUN 2
+
+#define SP_ARRAYMAX 4096 /* bigger arrays become bitmaps */
+#define SP_WORDS (65536 / BITS_PER_WORD) /* words in a bitmap */
+#define SP_MAXSIZE ((lua_Integer)1 << 32)
+#define SP_MAGIC "LBS1"
+
+typedef struct Container {
+    void *data;
+    int32_t n; /* values (array, bitmap) or runs */
+    int32_t cap; /* allocated values (array) or runs */
+    uint16_t key; /* high 16 bits of the indices in the chunk */
+    uint8_t type;
+} Container;
+
+typedef struct SparseArray {
+    lua_Integer size;
+    Container *c; /* containers, sorted by key */
+    int32_t n, cap;
+} SparseArray;
+
+static void *spalloc (lua_State *L, void *p, size_t nbytes) {
+    void *q = realloc(p, nbytes);
+    if (q == NULL)
+        luaL_error(L, "not enough memory");
+    return q;
+}
+
+/* first of the 'n' values of 'v' (taken every 'step') that is >= x */
+static int32_t lowerbound (const uint16_t *v, int32_t n, int step,
+        uint32_t x) {
+    int32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        int32_t m = lo + (hi - lo) / 2;
+        if (v[m * step] < x)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+/* runs are pairs (start, length - 1) */
+static int containsvalue (const Container *c, uint32_t x) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    int32_t p;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            p = lowerbound(v, c->n, 1, x);
+            return p < c->n && v[p] == x;
+        case SP_BITMAP:
+            return (((const uint64_t *)c->data)[I_WORD(x)] & I_BIT(x)) != 0;
+        default: /* last run starting at or before 'x' */
+            p = lowerbound(v, c->n, 2, x + 1) - 1;
+            return p >= 0 && x - v[2*p] <= v[2*p + 1];
+    }
+}
+
+/* first value >= x in a container, or -1 */
+static int32_t nextvalue (const Container *c, uint32_t x) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    int32_t p;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            p = lowerbound(v, c->n, 1, x);
+            return (p < c->n) ? v[p] : -1;
+        case SP_BITMAP:
+            return (int32_t)nextbit((const uint64_t *)c->data, SP_WORDS, x, 0);
+        default:
+            p = lowerbound(v, c->n, 2, x + 1) - 1;
+            if (p >= 0 && x - v[2*p] <= v[2*p + 1])
+                return (int32_t)x;
+            return (p + 1 < c->n) ? v[2*(p + 1)] : -1;
+    }
+}
+
+static int32_t cardinality (const Container *c) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    int32_t i, n = 0;
+
+    if (c->type != SP_RUN)
+        return c->n;
+    for (i = 0; i < c->n; i++)
+        n += v[2*i + 1] + 1;
+    return n;
+}
+
+static int32_t countwords (const uint64_t *w) {
+    int32_t i, n = 0;
+
+    for (i = 0; i < SP_WORDS; i++)
+        n += popcount64(w[i]);
+    return n;
+}
+
+/* set in the bitmap 'w' all values of 'c' */
+static void orwords (uint64_t *w, const Container *c) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    int32_t i;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            for (i = 0; i < c->n; i++)
+                w[I_WORD(v[i])] |= I_BIT(v[i]);
+            break;
+        case SP_BITMAP:
+            for (i = 0; i < SP_WORDS; i++)
+                w[i] |= ((const uint64_t *)c->data)[i];
+            break;
+        default:
+            for (i = 0; i < c->n; i++)
+                fillwords(w, v[2*i], (size_t)v[2*i] + v[2*i + 1], 1);
+    }
+}
+
+static void tobitmap (lua_State *L, Container *c) {
+    uint64_t *w;
+
+    if (c->type == SP_BITMAP)
+        return;
+    w = (uint64_t *)spalloc(L, NULL, SP_WORDS * sizeof(uint64_t));
+    memset(w, 0, SP_WORDS * sizeof(uint64_t));
+    orwords(w, c);
+    free(c->data);
+    c->data = w;
+    c->type = SP_BITMAP;
+    c->n = countwords(w);
+    c->cap = 0;
+}
+
+/* turn a bitmap with few values back into an array */
+static void shrink (lua_State *L, Container *c) {
+    const uint64_t *w = (const uint64_t *)c->data;
+    int32_t i, k = 0, cap = (c->n > 0) ? c->n : 1;
+    uint16_t *v;
+
+    if (c->type != SP_BITMAP || c->n > SP_ARRAYMAX)
+        return;
+    v = (uint16_t *)spalloc(L, NULL, cap * sizeof(uint16_t));
+    for (i = 0; i < SP_WORDS; i++) {
+        uint64_t bits;
+        for (bits = w[i]; bits != 0; bits &= bits - 1)
+            v[k++] = (uint16_t)(i * BITS_PER_WORD + ctz64(bits));
+    }
+    free(c->data);
+    c->data = v;
+    c->type = SP_ARRAY;
+    c->cap = cap;
+}
+
+static int32_t countruns (const Container *c) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    const uint64_t *w = (const uint64_t *)c->data;
+    int32_t i, n = 0;
+    uint64_t carry = 0;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            for (i = 0; i < c->n; i++)
+                n += (i == 0 || v[i] != v[i - 1] + 1);
+            return n;
+        case SP_BITMAP: /* count the 1s with a 0 before them */
+            for (i = 0; i < SP_WORDS; i++) {
+                n += popcount64(w[i] & ~((w[i] << 1) | carry));
+                carry = w[i] >> (BITS_PER_WORD - 1);
+            }
+            return n;
+        default:
+            return c->n;
+    }
+}
+
+static void torun (lua_State *L, Container *c, int32_t nruns) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    uint16_t *r;
+    int32_t i, k = 0;
+
+    if (c->type == SP_RUN)
+        return;
+    r = (uint16_t *)spalloc(L, NULL, 2 * nruns * sizeof(uint16_t));
+    if (c->type == SP_ARRAY) {
+        for (i = 0; i < c->n; i++) {
+            if (i == 0 || v[i] != v[i - 1] + 1) {
+                r[2*k] = v[i];
+                r[2*k + 1] = 0;
+                k++;
+            }
+            else
+                r[2*k - 1]++;
+        }
+    }
+    else {
+        const uint64_t *w = (const uint64_t *)c->data;
+        lua_Integer x = nextbit(w, SP_WORDS, 0, 0), e;
+        while (x >= 0) {
+            e = nextbit(w, SP_WORDS, (size_t)x, ~(uint64_t)0);
+            if (e < 0)
+                e = 65536;
+            r[2*k] = (uint16_t)x;
+            r[2*k + 1] = (uint16_t)(e - x - 1);
+            k++;
+            x = (e < 65536) ? nextbit(w, SP_WORDS, (size_t)e, 0) : -1;
+        }
+    }
+    free(c->data);
+    c->data = r;
+    c->type = SP_RUN;
+    c->n = c->cap = nruns;
+}
+
+/* 'c' becomes a single run */
+static void setrun (lua_State *L, Container *c, uint32_t lo, uint32_t hi) {
+    uint16_t *r = (uint16_t *)spalloc(L, NULL, 2 * sizeof(uint16_t));
+
+    r[0] = (uint16_t)lo;
+    r[1] = (uint16_t)(hi - lo);
+    free(c->data);
+    c->data = r;
+    c->type = SP_RUN;
+    c->n = c->cap = 1;
+}
+
+/* add lo..hi to a list of runs, merging the runs it touches */
+static void addrun (lua_State *L, Container *c, uint32_t lo, uint32_t hi) {
+    uint16_t *r = (uint16_t *)c->data;
+    int32_t p = lowerbound(r, c->n, 2, lo + 1) - 1, q;
+
+    if (p >= 0 && lo <= (uint32_t)r[2*p] + r[2*p + 1] + 1)
+        lo = r[2*p]; /* extends run 'p' */
+    else
+        p++;
+    for (q = p; q < c->n && r[2*q] <= hi + 1; q++)
+        if ((uint32_t)r[2*q] + r[2*q + 1] > hi)
+            hi = (uint32_t)r[2*q] + r[2*q + 1];
+    if (q == p) { /* a new run */
+        if (c->n == c->cap) {
+            c->data = spalloc(L, c->data, 4 * c->cap * sizeof(uint16_t));
+            c->cap *= 2;
+            r = (uint16_t *)c->data;
+        }
+        memmove(r + 2*(p + 1), r + 2*p, 2 * (c->n - p) * sizeof(uint16_t));
+        c->n++;
+    }
+    else { /* replaces runs p..q-1 */
+        memmove(r + 2*(p + 1), r + 2*q, 2 * (c->n - q) * sizeof(uint16_t));
+        c->n -= q - p - 1;
+    }
+    r[2*p] = (uint16_t)lo;
+    r[2*p + 1] = (uint16_t)(hi - lo);
+}
+
+static void addvalue (lua_State *L, Container *c, uint32_t x) {
+    uint16_t *v;
+    int32_t p;
+
+    if (containsvalue(c, x))
+        return;
+    if (c->type == SP_RUN) {
+        tobitmap(L, c);
+        shrink(L, c);
+    }
+    if (c->type == SP_ARRAY && c->n == SP_ARRAYMAX)
+        tobitmap(L, c);
+    if (c->type == SP_BITMAP)
+        ((uint64_t *)c->data)[I_WORD(x)] |= I_BIT(x);
+    else {
+        if (c->n == c->cap) {
+            int32_t cap = (c->cap > 0) ? 2 * c->cap : 4;
+            if (cap > SP_ARRAYMAX)
+                cap = SP_ARRAYMAX;
+            c->data = spalloc(L, c->data, cap * sizeof(uint16_t));
+            c->cap = cap;
+        }
+        v = (uint16_t *)c->data;
+        p = lowerbound(v, c->n, 1, x);
+        memmove(v + p + 1, v + p, (c->n - p) * sizeof(uint16_t));
+        v[p] = (uint16_t)x;
+    }
+    c->n++;
+}
+
+static void removevalue (lua_State *L, Container *c, uint32_t x) {
+    uint16_t *v;
+    int32_t p;
+
+    if (!containsvalue(c, x))
+        return;
+    if (c->type == SP_RUN)
+        tobitmap(L, c);
+    if (c->type == SP_BITMAP) {
+        ((uint64_t *)c->data)[I_WORD(x)] &= ~I_BIT(x);
+        c->n--;
+        shrink(L, c);
+    }
+    else {
+        v = (uint16_t *)c->data;
+        p = lowerbound(v, c->n, 1, x);
+        memmove(v + p, v + p + 1, (c->n - p - 1) * sizeof(uint16_t));
+        c->n--;
+    }
+}
+
+static void copycontainer (lua_State *L, Container *c, const Container *from) {
+    size_t nbytes;
+    void *data;
+
+    if (from->type == SP_BITMAP)
+        nbytes = SP_WORDS * sizeof(uint64_t);
+    else
+        nbytes = (from->type == SP_RUN ? 2 : 1) * from->n * sizeof(uint16_t);
+    data = spalloc(L, NULL, nbytes > 0 ? nbytes : 1);
+    memcpy(data, from->data, nbytes);
+    free(c->data);
+    c->data = data;
+    c->type = from->type;
+    c->n = from->n;
+    c->cap = (from->type == SP_BITMAP) ? 0 : from->n;
+}
+
+static void unioncontainer (lua_State *L, Container *c, const Container *b) {
+    if (b->n == 0)
+        return;
+    if (c->n == 0)
+        copycontainer(L, c, b);
+    else if (c->type == SP_ARRAY && b->type == SP_ARRAY &&
+            c->n + b->n <= SP_ARRAYMAX) { /* merge the arrays */
+        const uint16_t *x = (const uint16_t *)c->data;
+        const uint16_t *y = (const uint16_t *)b->data;
+        int32_t i = 0, j = 0, k = 0, cap = c->n + b->n;
+        uint16_t *v = (uint16_t *)spalloc(L, NULL, cap * sizeof(uint16_t));
+
+        while (i < c->n && j < b->n) {
+            if (x[i] < y[j])
+                v[k++] = x[i++];
+            else if (y[j] < x[i])
+                v[k++] = y[j++];
+            else {
+                v[k++] = x[i++];
+                j++;
+            }
+        }
+        while (i < c->n)
+            v[k++] = x[i++];
+        while (j < b->n)
+            v[k++] = y[j++];
+        free(c->data);
+        c->data = v;
+        c->n = k;
+        c->cap = cap;
+    }
+    else {
+        tobitmap(L, c);
+        orwords((uint64_t *)c->data, b);
+        c->n = countwords((const uint64_t *)c->data);
+    }
+}
+
+static void intercontainer (lua_State *L, Container *c, const Container *b) {
+    int32_t i, k = 0;
+
+    if (c->type == SP_ARRAY) { /* keep the values that are in 'b' */
+        uint16_t *v = (uint16_t *)c->data;
+        for (i = 0; i < c->n; i++)
+            if (containsvalue(b, v[i]))
+                v[k++] = v[i];
+        c->n = k;
+    }
+    else if (b->type == SP_ARRAY) { /* the values of 'b' that are in 'c' */
+        const uint16_t *y = (const uint16_t *)b->data;
+        int32_t cap = (b->n > 0) ? b->n : 1;
+        uint16_t *v = (uint16_t *)spalloc(L, NULL, cap * sizeof(uint16_t));
+        for (i = 0; i < b->n; i++)
+            if (containsvalue(c, y[i]))
+                v[k++] = y[i];
+        free(c->data);
+        c->data = v;
+        c->type = SP_ARRAY;
+        c->n = k;
+        c->cap = cap;
+    }
+    else { /* bitmaps or runs */
+        uint64_t *w;
+        tobitmap(L, c);
+        w = (uint64_t *)c->data;
+        if (b->type == SP_BITMAP) {
+            for (i = 0; i < SP_WORDS; i++)
+                w[i] &= ((const uint64_t *)b->data)[i];
+        }
+        else {
+            uint64_t *m = (uint64_t *)spalloc(L, NULL,
+                    SP_WORDS * sizeof(uint64_t));
+            memset(m, 0, SP_WORDS * sizeof(uint64_t));
+            orwords(m, b);
+            for (i = 0; i < SP_WORDS; i++)
+                w[i] &= m[i];
+            free(m);
+        }
+        c->n = countwords(w);
+        shrink(L, c);
+    }
+}
+
+/* index of the first container with key >= 'key' */
+static int32_t findcontainer (const SparseArray *s, uint32_t key) {
+    int32_t lo = 0, hi = s->n;
+
+    while (lo < hi) {
+        int32_t m = lo + (hi - lo) / 2;
+        if (s->c[m].key < key)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+static void reservecontainers (lua_State *L, SparseArray *s, int32_t n) {
+    if (n > s->cap) {
+        int32_t cap = (2 * s->cap > n) ? 2 * s->cap : n;
+        s->c = (Container *)spalloc(L, s->c, cap * sizeof(Container));
+        s->cap = cap;
+    }
+}
+
+/* the container for chunk 'key', created empty if needed */
+static Container *getcontainer (lua_State *L, SparseArray *s, uint32_t key) {
+    int32_t p = findcontainer(s, key);
+    Container *c;
+
+    if (p < s->n && s->c[p].key == key)
+        return &s->c[p];
+    reservecontainers(L, s, s->n + 1);
+    c = &s->c[p];
+    memmove(c + 1, c, (s->n - p) * sizeof(Container));
+    c->data = NULL;
+    c->n = c->cap = 0;
+    c->key = (uint16_t)key;
+    c->type = SP_ARRAY;
+    s->n++;
+    return c;
+}
+
+static void removecontainer (SparseArray *s, int32_t p) {
+    free(s->c[p].data);
+    memmove(&s->c[p], &s->c[p + 1], (s->n - p - 1) * sizeof(Container));
+    s->n--;
+}
+
+/* remove the empty containers */
+static void dropempty (SparseArray *s) {
+    int32_t i, k = 0;
+
+    for (i = 0; i < s->n; i++) {
+        if (s->c[i].n > 0)
+            s->c[k++] = s->c[i];
+        else
+            free(s->c[i].data);
+    }
+    s->n = k;
+}
+
+/* first index >= x (0-based) with its bit set, or -1 */
+static lua_Integer nextinsparse (const SparseArray *s, lua_Integer x) {
+    int32_t p;
+
+    if (x < 0)
+        x = 0;
+    if (x >= s->size)
+        return -1;
+    for (p = findcontainer(s, (uint32_t)(x >> 16)); p < s->n; p++) {
+        const Container *c = &s->c[p];
+        uint32_t from = (c->key == (x >> 16)) ? (uint32_t)(x & 0xffff) : 0;
+        int32_t v = nextvalue(c, from);
+        if (v >= 0)
+            return ((lua_Integer)c->key << 16) + v;
+    }
+    return -1;
+}
+
+static SparseArray *pushsparse (lua_State *L, lua_Integer size) {
+    SparseArray *s = (SparseArray *)lua_newuserdata(L, sizeof(SparseArray));
+
+    s->size = size;
+    s->c = NULL;
+    s->n = s->cap = 0;
+    luaL_getmetatable(L, "LuaBook.sparse");
+    lua_setmetatable(L, -2);
+    return s;
+}
+
+/* array.sparse([n]): 'n' bits (default 2^32, the maximum) */
+static int newsparse (lua_State *L) {
+    lua_Integer n = luaL_optinteger(L, 1, SP_MAXSIZE);
+
+    luaL_argcheck(L, 1 <= n && n <= SP_MAXSIZE, 1, "invalid size");
+    pushsparse(L, n);
+    return 1;
+}
+
+static int gcsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    int32_t i;
+
+    for (i = 0; i < s->n; i++)
+        free(s->c[i].data);
+    free(s->c);
+    s->c = NULL;
+    s->n = s->cap = 0;
+    return 0;
+}
+
+/* 0-based bit index from the 1-based index at 'arg' */
+static uint32_t checkbit (lua_State *L, SparseArray *s, int arg) {
+    lua_Integer i = luaL_checkinteger(L, arg);
+
+    luaL_argcheck(L, 1 <= i && i <= s->size, arg, "index out of range");
+    return (uint32_t)(i - 1);
+}
+
+static int setsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    uint32_t x = checkbit(L, s, 2);
+    int32_t p;
+
+    luaL_checkany(L, 3);
+    if (lua_toboolean(L, 3))
+        addvalue(L, getcontainer(L, s, x >> 16), x & 0xffff);
+    else {
+        p = findcontainer(s, x >> 16);
+        if (p < s->n && s->c[p].key == (x >> 16)) {
+            removevalue(L, &s->c[p], x & 0xffff);
+            if (s->c[p].n == 0)
+                removecontainer(s, p);
+        }
+    }
+    return 0;
+}
+
+static int getsparse (lua_State *L) {
+    SparseArray *s;
+    uint32_t x;
+    int32_t p;
+
+    if (lua_type(L, 2) == LUA_TSTRING) { /* a method? */
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1)); /* the methods */
+        return 1;
+    }
+    s = checksparse(L);
+    x = checkbit(L, s, 2);
+    p = findcontainer(s, x >> 16);
+    lua_pushboolean(L, p < s->n && s->c[p].key == (x >> 16) &&
+            containsvalue(&s->c[p], x & 0xffff));
+    return 1;
+}
+
+static int sizesparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    lua_pushinteger(L, s->size);
+    return 1;
+}
+
+static int sparse2string (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    lua_pushfstring(L, "sparse(%I)", s->size);
+    return 1;
+}
+
+/* s:count(): number of bits set */
+static int countsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    lua_Integer n = 0;
+    int32_t i;
+
+    for (i = 0; i < s->n; i++)
+        n += cardinality(&s->c[i]);
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static SparseArray *checkothersparse (lua_State *L, SparseArray *s) {
+    SparseArray *b = (SparseArray *)luaL_checkudata(L, 2, "LuaBook.sparse");
+    luaL_argcheck(L, b->size == s->size, 2, "arrays of different sizes");
+    return b;
+}
+
+/* s:bor(b): add the bits of 'b' to 's'; return 's' */
+static int orsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    SparseArray *b = checkothersparse(L, s);
+    int32_t i, j, k, extra = 0;
+
+    lua_settop(L, 1);
+    if (s == b)
+        return 1;
+    for (i = 0, j = 0; j < b->n; j++) { /* chunks of 'b' not in 's' */
+        while (i < s->n && s->c[i].key < b->c[j].key)
+            i++;
+        if (i == s->n || s->c[i].key != b->c[j].key)
+            extra++;
+    }
+    /* insert empty containers for them, merging from the end */
+    reservecontainers(L, s, s->n + extra);
+    i = s->n - 1;
+    k = s->n + extra - 1;
+    for (j = b->n - 1; j >= 0; j--) {
+        while (i >= 0 && s->c[i].key > b->c[j].key)
+            s->c[k--] = s->c[i--];
+        if (i >= 0 && s->c[i].key == b->c[j].key)
+            s->c[k--] = s->c[i--];
+        else {
+            s->c[k].data = NULL;
+            s->c[k].n = s->c[k].cap = 0;
+            s->c[k].key = b->c[j].key;
+            s->c[k].type = SP_ARRAY;
+            k--;
+        }
+    }
+    s->n += extra;
+    for (i = 0, j = 0; j < b->n; j++) {
+        while (s->c[i].key < b->c[j].key)
+            i++;
+        unioncontainer(L, &s->c[i], &b->c[j]);
+    }
+    return 1;
+}
+
+/* s:band(b): keep only the bits of 's' that are also in 'b'; return 's' */
+static int andsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    SparseArray *b = checkothersparse(L, s);
+    int32_t i, j;
+
+    lua_settop(L, 1);
+    if (s == b)
+        return 1;
+    for (i = 0, j = 0; i < s->n; i++) {
+        Container *c = &s->c[i];
+        while (j < b->n && b->c[j].key < c->key)
+            j++;
+        if (j < b->n && b->c[j].key == c->key)
+            intercontainer(L, c, &b->c[j]);
+        else
+            c->n = 0;
+    }
+    dropempty(s);
+    return 1;
+}
+
+/* s:setrange(i [, j]) and s:clearrange(i [, j]); ranges set in empty
+   chunks or in lists of runs stay runs, and whole chunks become single
+   runs (or go away) */
+static int rangesparse (lua_State *L, int set) {
+    SparseArray *s = checksparse(L);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    lua_Integer j = luaL_optinteger(L, 3, s->size);
+    lua_Integer x;
+
+    luaL_argcheck(L, 1 <= i && i <= s->size, 2, "index out of range");
+    luaL_argcheck(L, 1 <= j && j <= s->size, 3, "index out of range");
+    for (x = i - 1; x <= j - 1; x = (x | 0xffff) + 1) {
+        uint32_t key = (uint32_t)(x >> 16);
+        uint32_t lo = (uint32_t)(x & 0xffff);
+        uint32_t hi = ((j - 1) >> 16 == key) ? (uint32_t)((j - 1) & 0xffff)
+                                             : 0xffff;
+        int32_t p;
+        Container *c;
+
+        if (set) {
+            c = getcontainer(L, s, key);
+            if (c->n == 0 || (lo == 0 && hi == 0xffff))
+                setrun(L, c, lo, hi);
+            else if (c->type == SP_RUN)
+                addrun(L, c, lo, hi);
+            else {
+                tobitmap(L, c);
+                fillwords((uint64_t *)c->data, lo, hi, 1);
+                c->n = countwords((const uint64_t *)c->data);
+            }
+        }
+        else {
+            p = findcontainer(s, key);
+            if (p == s->n || s->c[p].key != key)
+                continue;
+            c = &s->c[p];
+            if (lo == 0 && hi == 0xffff)
+                c->n = 0;
+            else {
+                tobitmap(L, c);
+                fillwords((uint64_t *)c->data, lo, hi, 0);
+                c->n = countwords((const uint64_t *)c->data);
+                shrink(L, c);
+            }
+            if (c->n == 0)
+                removecontainer(s, p);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int setrangesparse (lua_State *L) {
+    return rangesparse(L, 1);
+}
+
+static int clearrangesparse (lua_State *L) {
+    return rangesparse(L, 0);
+}
+
+/* s:nextset([i]): index of the first bit from 'i' (default 1) on that
+   is set, or nil */
+static int nextsetsparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+
+    luaL_argcheck(L, 1 <= i, 2, "index out of range");
+    i = nextinsparse(s, i - 1);
+    if (i < 0)
+        return 0;
+    lua_pushinteger(L, i + 1);
+    return 1;
+}
+
+static int itersparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    lua_Integer i = nextinsparse(s, luaL_checkinteger(L, 2)); /* after i */
+
+    if (i < 0)
+        return 0;
+    lua_pushinteger(L, i + 1);
+    return 1;
+}
+
+/* for i in s:bits() do ... end: the indices of the bits set, in order;
+   bits may be changed during the traversal */
+static int bitssparse (lua_State *L) {
+    checksparse(L);
+    lua_pushcfunction(L, itersparse);
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    return 3;
+}
+
+/* s:optimize(): give each chunk its smallest form, which can be a list
+   of runs; return 's' */
+static int optimizesparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    int32_t i;
+
+    for (i = 0; i < s->n; i++) {
+        Container *c = &s->c[i];
+        int32_t card = cardinality(c), nruns = countruns(c);
+        size_t setbytes = (card <= SP_ARRAYMAX)
+                ? card * sizeof(uint16_t) : SP_WORDS * sizeof(uint64_t);
+
+        if (c->n == 0)
+            continue;
+        if (2 * nruns * sizeof(uint16_t) < setbytes)
+            torun(L, c, nruns);
+        else if (c->type == SP_RUN) {
+            tobitmap(L, c);
+            shrink(L, c);
+        }
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+/*
+** Serialized format, with all numbers little-endian: "LBS1", the size
+** (8 bytes) and the number of containers (4 bytes); then, for each
+** container, its key (2 bytes), type (1 byte: 0 array, 1 bitmap,
+** 2 runs) and 'n' (4 bytes), followed by 'n' 16-bit values, 1024
+** 64-bit words or 'n' pairs of 16-bit (start, length - 1).
+*/
+
+static void putbytes (unsigned char *p, uint64_t v, int n) {
+    while (n-- > 0) {
+        *p++ = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static uint64_t getbytes (const unsigned char *p, int n) {
+    uint64_t v = 0;
+
+    while (n-- > 0)
+        v = (v << 8) | p[n];
+    return v;
+}
+
+static size_t payloadsize (int type, uint32_t n) {
+    switch (type) {
+        case SP_ARRAY: return n * sizeof(uint16_t);
+        case SP_BITMAP: return SP_WORDS * sizeof(uint64_t);
+        default: return 2 * n * sizeof(uint16_t);
+    }
+}
+
+/* s:serialize(): a string that array.unserialize turns back into 's' */
+static int serializesparse (lua_State *L) {
+    SparseArray *s = checksparse(L);
+    luaL_Buffer b;
+    unsigned char *p;
+    int32_t i, j, n = 0;
+
+    for (i = 0; i < s->n; i++)
+        n += (s->c[i].n > 0);
+    luaL_buffinit(L, &b);
+    p = (unsigned char *)luaL_prepbuffsize(&b, 16);
+    memcpy(p, SP_MAGIC, 4);
+    putbytes(p + 4, (uint64_t)s->size, 8);
+    putbytes(p + 12, (uint64_t)n, 4);
+    luaL_addsize(&b, 16);
+    for (i = 0; i < s->n; i++) {
+        const Container *c = &s->c[i];
+        size_t len = payloadsize(c->type, c->n);
+        const uint16_t *v = (const uint16_t *)c->data;
+
+        if (c->n == 0)
+            continue;
+        p = (unsigned char *)luaL_prepbuffsize(&b, 7 + len);
+        putbytes(p, c->key, 2);
+        p[2] = c->type;
+        putbytes(p + 3, (uint64_t)c->n, 4);
+        if (c->type == SP_BITMAP) {
+            for (j = 0; j < SP_WORDS; j++)
+                putbytes(p + 7 + 8*j, ((const uint64_t *)c->data)[j], 8);
+        }
+        else {
+            for (j = 0; j < (int32_t)(len / sizeof(uint16_t)); j++)
+                putbytes(p + 7 + 2*j, v[j], 2);
+        }
+        luaL_addsize(&b, 7 + len);
+    }
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* highest value in a non-empty container */
+static uint32_t lastvalue (const Container *c) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    const uint64_t *w = (const uint64_t *)c->data;
+    int32_t i = SP_WORDS - 1;
+    uint32_t x;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            return v[c->n - 1];
+        case SP_BITMAP:
+            while (w[i] == 0)
+                i--;
+            for (x = BITS_PER_WORD - 1; (w[i] & I_BIT(x)) == 0; x--)
+                ;
+            return i * BITS_PER_WORD + x;
+        default:
+            return (uint32_t)v[2*(c->n - 1)] + v[2*(c->n - 1) + 1];
+    }
+}
+
+/* check the contents of a decoded container */
+static int validcontainer (const Container *c) {
+    const uint16_t *v = (const uint16_t *)c->data;
+    int32_t i;
+
+    switch (c->type) {
+        case SP_ARRAY:
+            for (i = 1; i < c->n; i++)
+                if (v[i] <= v[i - 1])
+                    return 0;
+            return 1;
+        case SP_BITMAP:
+            return countwords((const uint64_t *)c->data) == c->n;
+        default:
+            for (i = 0; i < c->n; i++) {
+                if ((uint32_t)v[2*i] + v[2*i + 1] > 0xffff)
+                    return 0;
+                if (i > 0 && v[2*i] <= (uint32_t)v[2*i - 2] + v[2*i - 1])
+                    return 0;
+            }
+            return 1;
+    }
+}
+
+/* array.unserialize(str): the sparse array serialized in 'str' */
+static int unserializesparse (lua_State *L) {
+    size_t len;
+    const unsigned char *p = (const unsigned char *)
+            luaL_checklstring(L, 1, &len);
+    const unsigned char *end = p + len;
+    uint64_t size;
+    uint32_t i, j, n;
+    SparseArray *s;
+
+    if (len < 16 || memcmp(p, SP_MAGIC, 4) != 0)
+        return luaL_argerror(L, 1, "not a serialized sparse array");
+    size = getbytes(p + 4, 8);
+    n = (uint32_t)getbytes(p + 12, 4);
+    if (size < 1 || size > (uint64_t)SP_MAXSIZE || n > ((size - 1) >> 16) + 1)
+        return luaL_argerror(L, 1, "invalid sparse array data");
+    s = pushsparse(L, (lua_Integer)size); /* frees what follows on errors */
+    reservecontainers(L, s, (n > 0) ? n : 1);
+    for (p += 16, i = 0; i < n; i++) {
+        Container *c = &s->c[i];
+        uint32_t key, cn;
+        size_t plen;
+        int type;
+
+        if (end - p < 7)
+            break;
+        key = (uint32_t)getbytes(p, 2);
+        type = p[2];
+        cn = (uint32_t)getbytes(p + 3, 4);
+        if ((i > 0 && key <= s->c[i - 1].key) || type > SP_RUN || cn == 0 ||
+                cn > (type == SP_ARRAY ? SP_ARRAYMAX : 65536))
+            break;
+        plen = payloadsize(type, cn);
+        if ((size_t)(end - p - 7) < plen)
+            break;
+        p += 7;
+        c->data = spalloc(L, NULL, plen);
+        c->n = c->cap = (int32_t)cn;
+        c->key = (uint16_t)key;
+        c->type = (uint8_t)type;
+        s->n++;
+        if (type == SP_BITMAP) {
+            c->cap = 0;
+            for (j = 0; j < SP_WORDS; j++)
+                ((uint64_t *)c->data)[j] = getbytes(p + 8*j, 8);
+        }
+        else {
+            for (j = 0; j < plen / sizeof(uint16_t); j++)
+                ((uint16_t *)c->data)[j] = (uint16_t)getbytes(p + 2*j, 2);
+        }
+        p += plen;
+        if (!validcontainer(c) ||
+                ((uint64_t)key << 16) + lastvalue(c) >= size)
+            break;
+    }
+    if (i < n || p != end)
+        return luaL_argerror(L, 1, "invalid sparse array data");
+    return 1;
+}
+
+/*
+** Typed numeric arrays: 'size' numbers of one C type, stored one after
+** the other. The kernels below are plain loops over the elements that
+** the compiler can vectorize; sums of floats go into NA_LANES partial
+** sums, as the compiler cannot reorder float additions by itself.
+*/
+
+#define checknumarray(L, i) \
+    (NumArray *)luaL_checkudata(L, i, "LuaBook.numarray")
+
+#define NA_INT32 0
+#define NA_INT64 1
+#define NA_FLOAT32 2
+#define NA_FLOAT64 3
+
+#define NA_LANES 8
+
+#define isfloat(a) ((a)->type >= NA_FLOAT32)
+
+static const char *const na_types[] = {
+    "int32", "int64", "float32", "float64", NULL
+};
+static const size_t na_sizes[] = {
+    sizeof(int32_t), sizeof(int64_t), sizeof(float), sizeof(double)
+};
+
+typedef struct NumArray {
+    lua_Integer size;
+    int type;
+    union {
+        int32_t i32[1];
+        int64_t i64[1];
+        float f32[1];
+        double f64[1];
+    } data; /* variable part */
+} NumArray;
+
+/* expand K(T, U, f) for the type of 'a': T is the element type, f the
+   member of 'data', and U the type to compute in (unsigned for the
+   integers, so that they wrap around as in Lua) */
+#define NA_SWITCH(a, K) \
+    switch ((a)->type) { \
+        case NA_INT32: K(int32_t, uint32_t, i32) break; \
+        case NA_INT64: K(int64_t, uint64_t, i64) break; \
+        case NA_FLOAT32: K(float, float, f32) break; \
+        default: K(double, double, f64) break; \
+    }
+
+static NumArray *pushnumarray (lua_State *L, int type, lua_Integer n) {
+    size_t nbytes;
+    NumArray *a;
+
+    luaL_argcheck(L, n >= 0 && (size_t)n <=
+            (SIZE_MAX - sizeof(NumArray)) / na_sizes[type], 2,
+            "invalid size");
+    nbytes = offsetof(NumArray, data) + (size_t)n * na_sizes[type];
+    a = (NumArray *)lua_newuserdata(L, nbytes);
+    a->size = n;
+    a->type = type;
+    memset(&a->data, 0, (size_t)n * na_sizes[type]);
+    luaL_getmetatable(L, "LuaBook.numarray");
+    lua_setmetatable(L, -2);
+    return a;
+}
+
+/* store the value at 'idx' into element 'i' (0-based) */
+static void setelement (lua_State *L, NumArray *a, size_t i, int idx) {
+    int isnum;
+
+    if (isfloat(a)) {
+        lua_Number v = lua_tonumberx(L, idx, &isnum);
+        if (!isnum)
+            luaL_error(L, "number expected, got %s", luaL_typename(L, idx));
+        if (a->type == NA_FLOAT32)
+            a->data.f32[i] = (float)v;
+        else
+            a->data.f64[i] = (double)v;
+    }
+    else {
+        lua_Integer v = lua_tointegerx(L, idx, &isnum);
+        if (!isnum)
+            luaL_error(L, "integer expected, got %s",
+                    lua_isnumber(L, idx) ? "float" : luaL_typename(L, idx));
+        if (a->type == NA_INT64)
+            a->data.i64[i] = (int64_t)v;
+        else if (INT32_MIN <= v && v <= INT32_MAX)
+            a->data.i32[i] = (int32_t)v;
+        else
+            luaL_error(L, "value out of range for int32");
+    }
+}
+
+static void pushelement (lua_State *L, const NumArray *a, size_t i) {
+    switch (a->type) {
+        case NA_INT32: lua_pushinteger(L, a->data.i32[i]); break;
+        case NA_INT64: lua_pushinteger(L, (lua_Integer)a->data.i64[i]); break;
+        case NA_FLOAT32: lua_pushnumber(L, a->data.f32[i]); break;
+        default: lua_pushnumber(L, (lua_Number)a->data.f64[i]); break;
+    }
+}
+
+/* array.typed(type, n) or array.typed(type, list): an array of 'n'
+   zeros, or with the numbers in 'list' */
+static int newnumarray (lua_State *L) {
+    int type = luaL_checkoption(L, 1, NULL, na_types);
+    NumArray *a;
+    lua_Integer i, n;
+
+    if (lua_istable(L, 2)) {
+        n = luaL_len(L, 2);
+        a = pushnumarray(L, type, n);
+        for (i = 0; i < n; i++) {
+            lua_geti(L, 2, i + 1);
+            setelement(L, a, (size_t)i, -1);
+            lua_pop(L, 1);
+        }
+    }
+    else
+        pushnumarray(L, type, luaL_checkinteger(L, 2));
+    return 1;
+}
+
+/* the 0-based element index from the 1-based index at 'arg' */
+static size_t checkelement (lua_State *L, NumArray *a, int arg) {
+    lua_Integer i = luaL_checkinteger(L, arg);
+
+    luaL_argcheck(L, 1 <= i && i <= a->size, arg, "index out of range");
+    return (size_t)(i - 1);
+}
+
+static int setnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i = checkelement(L, a, 2);
+
+    luaL_checkany(L, 3);
+    setelement(L, a, i, 3);
+    return 0;
+}
+
+static int getnumarray (lua_State *L) {
+    NumArray *a;
+
+    if (lua_type(L, 2) == LUA_TSTRING) { /* a method? */
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1)); /* the methods */
+        return 1;
+    }
+    a = checknumarray(L, 1);
+    pushelement(L, a, checkelement(L, a, 2));
+    return 1;
+}
+
+static int sizenumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    lua_pushinteger(L, a->size);
+    return 1;
+}
+
+static int numarray2string (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    lua_pushfstring(L, "%s array(%I)", na_types[a->type], a->size);
+    return 1;
+}
+
+/* a:type(): the name of the element type */
+static int typenumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    lua_pushstring(L, na_types[a->type]);
+    return 1;
+}
+
+/* a:totable(): a list with the elements */
+static int totablenumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    lua_Integer i;
+
+    lua_createtable(L, (int)(a->size < INT_MAX ? a->size : INT_MAX), 0);
+    for (i = 0; i < a->size; i++) {
+        pushelement(L, a, (size_t)i);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/* the second operand of a binary operation: same type and size */
+static NumArray *checkothernum (lua_State *L, NumArray *a) {
+    NumArray *b = checknumarray(L, 2);
+    luaL_argcheck(L, b->type == a->type && b->size == a->size, 2,
+            "arrays of different types or sizes");
+    return b;
+}
+
+/* integers are summed in 64 bits, wrapping around; floats in double */
+#define NA_SUM(T, U, f) { \
+    const T *x = a->data.f; \
+    if (isfloat(a)) { \
+        double s[NA_LANES] = {0}; \
+        for (i = 0; i + NA_LANES <= n; i += NA_LANES) \
+            for (k = 0; k < NA_LANES; k++) \
+                s[k] += (double)x[i + k]; \
+        for (; i < n; i++) \
+            s[0] += (double)x[i]; \
+        for (k = 1; k < NA_LANES; k++) \
+            s[0] += s[k]; \
+        lua_pushnumber(L, (lua_Number)s[0]); \
+    } \
+    else { \
+        uint64_t s[NA_LANES] = {0}; \
+        for (i = 0; i + NA_LANES <= n; i += NA_LANES) \
+            for (k = 0; k < NA_LANES; k++) \
+                s[k] += (uint64_t)(int64_t)x[i + k]; \
+        for (; i < n; i++) \
+            s[0] += (uint64_t)(int64_t)x[i]; \
+        for (k = 1; k < NA_LANES; k++) \
+            s[0] += s[k]; \
+        lua_pushinteger(L, (lua_Integer)s[0]); \
+    } \
+}
+
+/* a:sum() */
+static int sumnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i, k, n = (size_t)a->size;
+
+    NA_SWITCH(a, NA_SUM)
+    return 1;
+}
+
+#define NA_DOT(T, U, f) { \
+    const T *x = a->data.f, *y = b->data.f; \
+    if (isfloat(a)) { \
+        double s[NA_LANES] = {0}; \
+        for (i = 0; i + NA_LANES <= n; i += NA_LANES) \
+            for (k = 0; k < NA_LANES; k++) \
+                s[k] += (double)x[i + k] * (double)y[i + k]; \
+        for (; i < n; i++) \
+            s[0] += (double)x[i] * (double)y[i]; \
+        for (k = 1; k < NA_LANES; k++) \
+            s[0] += s[k]; \
+        lua_pushnumber(L, (lua_Number)s[0]); \
+    } \
+    else { \
+        uint64_t s[NA_LANES] = {0}; \
+        for (i = 0; i + NA_LANES <= n; i += NA_LANES) \
+            for (k = 0; k < NA_LANES; k++) \
+                s[k] += (uint64_t)(int64_t)x[i + k] * \
+                        (uint64_t)(int64_t)y[i + k]; \
+        for (; i < n; i++) \
+            s[0] += (uint64_t)(int64_t)x[i] * (uint64_t)(int64_t)y[i]; \
+        for (k = 1; k < NA_LANES; k++) \
+            s[0] += s[k]; \
+        lua_pushinteger(L, (lua_Integer)s[0]); \
+    } \
+}
+
+/* a:dot(b): sum of the products of the elements */
+static int dotnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    NumArray *b = checkothernum(L, a);
+    size_t i, k, n = (size_t)a->size;
+
+    NA_SWITCH(a, NA_DOT)
+    return 1;
+}
+
+/* smallest (OP is <) or largest (>) element; NaNs give unspecified
+   results */
+#define NA_EXTREME(T, f, OP) { \
+    const T *x = a->data.f; \
+    T m[NA_LANES]; \
+    for (k = 0; k < NA_LANES; k++) \
+        m[k] = x[0]; \
+    for (i = 0; i + NA_LANES <= n; i += NA_LANES) \
+        for (k = 0; k < NA_LANES; k++) \
+            m[k] = (x[i + k] OP m[k]) ? x[i + k] : m[k]; \
+    for (; i < n; i++) \
+        m[0] = (x[i] OP m[0]) ? x[i] : m[0]; \
+    for (k = 1; k < NA_LANES; k++) \
+        m[0] = (m[k] OP m[0]) ? m[k] : m[0]; \
+    if (isfloat(a)) \
+        lua_pushnumber(L, (lua_Number)m[0]); \
+    else \
+        lua_pushinteger(L, (lua_Integer)m[0]); \
+}
+
+#define NA_MIN(T, U, f) NA_EXTREME(T, f, <)
+#define NA_MAX(T, U, f) NA_EXTREME(T, f, >)
+
+/* a:min() and a:max(); nil for an empty array */
+static int minnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i, k, n = (size_t)a->size;
+
+    if (n == 0)
+        lua_pushnil(L);
+    else
+        NA_SWITCH(a, NA_MIN)
+    return 1;
+}
+
+static int maxnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i, k, n = (size_t)a->size;
+
+    if (n == 0)
+        lua_pushnil(L);
+    else
+        NA_SWITCH(a, NA_MAX)
+    return 1;
+}
+
+/* x[i] = x[i] OP y, for y an element of 'b' or the scalar 's'; blocks
+   of NA_LANES elements are vectorized even at -O2 */
+#define NA_LOOP(T, U, OP, Y) \
+    for (j = 0; j + NA_LANES <= n; j += NA_LANES) \
+        for (i = j; i < j + NA_LANES; i++) \
+            x[i] = (T)((U)x[i] OP (U)(Y)); \
+    for (i = j; i < n; i++) \
+        x[i] = (T)((U)x[i] OP (U)(Y));
+
+#define NA_OPS(T, U, Y) \
+    switch (op) { \
+        case '+': NA_LOOP(T, U, +, Y) break; \
+        case '-': NA_LOOP(T, U, -, Y) break; \
+        case '*': NA_LOOP(T, U, *, Y) break; \
+        default: NA_LOOP(T, U, /, Y) break; \
+    }
+
+#define NA_ARITH(T, U, f) { \
+    T *restrict x = a->data.f; \
+    if (b == a) { /* 'x' is the only pointer to the elements */ \
+        NA_OPS(T, U, x[i]) \
+    } \
+    else if (b != NULL) { \
+        const T *restrict y = b->data.f; \
+        NA_OPS(T, U, y[i]) \
+    } \
+    else { \
+        T s = isfloat(a) ? (T)ns : (T)is; \
+        NA_OPS(T, U, s) \
+    } \
+}
+
+/* a:add(b), a:sub(b), a:mul(b), a:div(b): elementwise, in place; 'b'
+   is an array of the same type and size or a number (which must fit
+   the element type, for integer arrays); return 'a' */
+static int arithnumarray (lua_State *L, int op) {
+    NumArray *a = checknumarray(L, 1);
+    NumArray *b = NULL;
+    size_t i, j, n = (size_t)a->size;
+    lua_Integer is = 0;
+    lua_Number ns = 0;
+
+    luaL_argcheck(L, op != '/' || isfloat(a), 1,
+            "division of an integer array");
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        if (isfloat(a))
+            ns = lua_tonumber(L, 2);
+        else {
+            is = luaL_checkinteger(L, 2);
+            luaL_argcheck(L, a->type != NA_INT32 ||
+                    (INT32_MIN <= is && is <= INT32_MAX), 2,
+                    "value out of range for int32");
+        }
+    }
+    else
+        b = checkothernum(L, a);
+    NA_SWITCH(a, NA_ARITH)
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int addnumarray (lua_State *L) {
+    return arithnumarray(L, '+');
+}
+
+static int subnumarray (lua_State *L) {
+    return arithnumarray(L, '-');
+}
+
+static int mulnumarray (lua_State *L) {
+    return arithnumarray(L, '*');
+}
+
+static int divnumarray (lua_State *L) {
+    return arithnumarray(L, '/');
+}
+
+/* a:fill(v): set all elements to 'v'; return 'a' */
+static int fillnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i, n = (size_t)a->size, w = na_sizes[a->type];
+    char *p = (char *)&a->data;
+
+    luaL_checkany(L, 2);
+    if (n > 0)
+        setelement(L, a, 0, 2);
+    for (i = 1; i < n; i++)
+        memcpy(p + i * w, p, w);
+    lua_settop(L, 1);
+    return 1;
+}
+
+#define NA_CUMSUM(T, U, f) { \
+    T *x = a->data.f; \
+    for (i = 1; i < n; i++) \
+        x[i] = (T)((U)x[i] + (U)x[i - 1]); \
+}
+
+/* a:cumsum(): replace each element by the sum of it and the ones
+   before it; return 'a' */
+static int cumsumnumarray (lua_State *L) {
+    NumArray *a = checknumarray(L, 1);
+    size_t i, n = (size_t)a->size;
+
+    NA_SWITCH(a, NA_CUMSUM)
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* comparison functions for qsort; NaNs go after all numbers */
+#define NA_COMPARE(name, T) \
+    static int name (const void *p, const void *q) { \
+        T x = *(const T *)p, y = *(const T *)q; \
+        if (x < y) \
+            return -1; \
+        if (x > y) \
+            return 1; \
+        return (x != x) - (y != y); \
+    }
+
+NA_COMPARE(comparei32, int32_t)
+NA_COMPARE(comparei64, int64_t)
+NA_COMPARE(comparef32, float)
+NA_COMPARE(comparef64, double)
+
+/* a:sort(): sort in ascending order; return 'a' */
+static int sortnumarray (lua_State *L) {
+    static int (*const compare[])(const void *, const void *) = {
+        comparei32, comparei64, comparef32, comparef64
+    };
+    NumArray *a = checknumarray(L, 1);
+
+    qsort(&a->data, (size_t)a->size, na_sizes[a->type], compare[a->type]);
+    lua_settop(L, 1);
+    return 1;
+}
+
 #endif